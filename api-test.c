@@ -0,0 +1,345 @@
+/**
+ * @file api-test.c
+ * @brief Exercises the parts of the allocator interface that the traces
+ *        do not reach: a heap file detached by one process and attached by
+ *        the next, snapshot and restore, arenas, pools, and realloc
+ *        headroom
+ *
+ * Each check prints one line and ends with mm_checkheap.  The exit status
+ * is nonzero if any check fails.
+ */
+
+// GNU extensions used: fork and waitpid under -std=c11
+#define _GNU_SOURCE 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+/* Nodes in the list the persistence checks leave in the heap */
+#define NUM_NODES 1000
+
+/* A list node whose payload is a function of its position */
+typedef struct node {
+    struct node *next;
+    size_t value;
+    unsigned char fill[40];
+} node_t;
+
+static bool fail(const char *check, const char *what) {
+    fprintf(stderr, "ERROR: %s: %s\n", check, what);
+    return false;
+}
+
+static void fill_pattern(unsigned char *p, size_t len, size_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        p[i] = (unsigned char)(seed + i);
+    }
+}
+
+static bool has_pattern(const unsigned char *p, size_t len, size_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] != (unsigned char)(seed + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * build_list - allocate a list of NUM_NODES nodes, interleaved with freed
+ *     blocks of several sizes so that the free lists are not empty
+ */
+static node_t *build_list(void) {
+    node_t *head = NULL;
+    for (size_t i = 0; i < NUM_NODES; i++) {
+        void *gap = mm_malloc(16 + (i * 37) % 2000);
+        node_t *node = mm_malloc(sizeof(node_t));
+        if (node == NULL || gap == NULL) {
+            return NULL;
+        }
+        node->next = head;
+        node->value = i;
+        fill_pattern(node->fill, sizeof(node->fill), i);
+        head = node;
+        if (i % 3 != 0) {
+            mm_free(gap);
+        }
+    }
+    return head;
+}
+
+/*
+ * check_list - return whether the list from build_list is intact
+ */
+static bool check_list(const node_t *head) {
+    size_t expect = NUM_NODES;
+    for (const node_t *node = head; node != NULL; node = node->next) {
+        expect--;
+        if (node->value != expect ||
+            !has_pattern(node->fill, sizeof(node->fill), expect)) {
+            return false;
+        }
+    }
+    return expect == 0;
+}
+
+/*
+ * check_attach - build a list in a heap file in a child process, detach
+ *     it, and attach it here; the root must lead back to the whole list
+ */
+static bool check_attach(const char *path) {
+    const char *check = "detach/attach";
+    unlink(path);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        return fail(check, "fork failed");
+    }
+    if (pid == 0) {
+        bool ok = mem_init_file(path) && mm_init();
+        node_t *head = ok ? build_list() : NULL;
+        ok = head != NULL && mm_set_root(head) && mm_detach();
+        mem_deinit();
+        _exit(ok ? 0 : 1);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        return fail(check, "the detaching process failed");
+    }
+
+    bool ok = true;
+    if (!mem_init_file(path)) {
+        return fail(check, "cannot map the heap file");
+    }
+    if (!mm_attach()) {
+        ok = fail(check, "mm_attach refused the heap");
+    } else if (!check_list(mm_get_root())) {
+        ok = fail(check, "the root does not lead to the saved list");
+    } else if (mm_malloc(100) == NULL || !mm_checkheap(__LINE__)) {
+        ok = fail(check, "the attached heap is not usable");
+    }
+    mem_deinit();
+    unlink(path);
+    return ok;
+}
+
+/*
+ * check_snapshot - snapshot a heap holding a list, start a new heap, and
+ *     restore the snapshot over it
+ */
+static bool check_snapshot(const char *path) {
+    const char *check = "snapshot/restore";
+    bool ok = true;
+
+    mem_init(false);
+    node_t *head = mm_init() ? build_list() : NULL;
+    if (head == NULL) {
+        ok = fail(check, "cannot build the list");
+    } else if (!mm_snapshot(path)) {
+        ok = fail(check, "mm_snapshot failed");
+    }
+    mem_deinit();
+    if (!ok) {
+        return false;
+    }
+
+    mem_init(false);
+    if (!mm_init() || mm_malloc(5000) == NULL) {
+        ok = fail(check, "cannot start a new heap");
+    } else if (!mm_restore(path)) {
+        ok = fail(check, "mm_restore failed");
+    } else if (!mm_checkheap(__LINE__)) {
+        ok = fail(check, "the restored heap fails the heap check");
+    } else if (!check_list(head)) {
+        ok = fail(check, "the list did not survive");
+    } else if (mm_malloc(100) == NULL || !mm_checkheap(__LINE__)) {
+        ok = fail(check, "the restored heap is not usable");
+    }
+    mem_deinit();
+    unlink(path);
+    return ok;
+}
+
+/*
+ * check_arena - allocate from an arena, with requests on both sides of
+ *     the chunk size, then reset it, allocate again, and destroy it
+ */
+static bool check_arena(void) {
+    const char *check = "arena";
+    static const size_t sizes[] = {1, 24, 200, 4000, 4096, 10000, 100000, 48};
+    const size_t num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    unsigned char *blocks[sizeof(sizes) / sizeof(sizes[0])];
+    bool ok = true;
+
+    mem_init(false);
+    mm_arena_t *arena = mm_init() ? mm_arena_create() : NULL;
+    if (arena == NULL) {
+        mem_deinit();
+        return fail(check, "mm_arena_create failed");
+    }
+
+    for (int round = 0; round < 2 && ok; round++) {
+        for (size_t i = 0; i < num_sizes && ok; i++) {
+            blocks[i] = mm_arena_alloc(arena, sizes[i]);
+            if (blocks[i] == NULL || (uintptr_t)blocks[i] % 16 != 0) {
+                ok = fail(check, "bad allocation");
+            } else {
+                fill_pattern(blocks[i], sizes[i], i + (size_t)round);
+            }
+        }
+        for (size_t i = 0; i < num_sizes && ok; i++) {
+            if (!has_pattern(blocks[i], sizes[i], i + (size_t)round)) {
+                ok = fail(check, "allocations overlap");
+            }
+        }
+        if (ok && !mm_checkheap(__LINE__)) {
+            ok = fail(check, "the heap check fails");
+        }
+        mm_arena_reset(arena);
+    }
+
+    mm_arena_destroy(arena);
+    if (ok && (mm_malloc(200000) == NULL || !mm_checkheap(__LINE__))) {
+        ok = fail(check, "the heap is not usable after mm_arena_destroy");
+    }
+    mem_deinit();
+    return ok;
+}
+
+/*
+ * check_pool - allocate, free, and reallocate objects from pools with
+ *     alignments other than the default
+ */
+static bool check_pool(void) {
+    const char *check = "pool";
+    static const size_t shapes[][2] = {{24, 32}, {100, 64}, {8, 256},
+                                       {40, 0}, {3000, 128}};
+    enum { NUM_OBJECTS = 500 };
+    unsigned char *objects[NUM_OBJECTS];
+    bool ok = true;
+
+    mem_init(false);
+    if (!mm_init()) {
+        mem_deinit();
+        return fail(check, "mm_init failed");
+    }
+
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]) && ok; s++) {
+        size_t size = shapes[s][0];
+        size_t align = (shapes[s][1] == 0) ? 16 : shapes[s][1];
+        mm_pool_t *pool = mm_pool_create(size, shapes[s][1]);
+        if (pool == NULL) {
+            ok = fail(check, "mm_pool_create failed");
+            break;
+        }
+
+        for (size_t i = 0; i < NUM_OBJECTS && ok; i++) {
+            objects[i] = mm_pool_alloc(pool);
+            if (objects[i] == NULL || (uintptr_t)objects[i] % align != 0) {
+                ok = fail(check, "bad allocation");
+            } else {
+                fill_pattern(objects[i], size, i);
+            }
+        }
+        for (size_t i = 0; i < NUM_OBJECTS && ok; i += 2) {
+            mm_pool_free(pool, objects[i]);
+        }
+        for (size_t i = 0; i < NUM_OBJECTS && ok; i += 2) {
+            objects[i] = mm_pool_alloc(pool);
+            if (objects[i] == NULL || (uintptr_t)objects[i] % align != 0) {
+                ok = fail(check, "bad allocation after free");
+            } else {
+                fill_pattern(objects[i], size, i);
+            }
+        }
+        for (size_t i = 0; i < NUM_OBJECTS && ok; i++) {
+            if (!has_pattern(objects[i], size, i)) {
+                ok = fail(check, "objects overlap");
+            }
+        }
+        if (ok && !mm_checkheap(__LINE__)) {
+            ok = fail(check, "the heap check fails");
+        }
+        mm_pool_destroy(pool);
+    }
+
+    if (ok && (mm_malloc(200000) == NULL || !mm_checkheap(__LINE__))) {
+        ok = fail(check, "the heap is not usable after mm_pool_destroy");
+    }
+    mem_deinit();
+    return ok;
+}
+
+/*
+ * check_headroom - grow a block with realloc headroom down into the free
+ *     block before it, then fill it and let mm_maintain trim the headroom
+ */
+static bool check_headroom(void) {
+    const char *check = "realloc headroom";
+    bool ok = true;
+
+    mem_init(false);
+    if (!mm_init()) {
+        mem_deinit();
+        return fail(check, "mm_init failed");
+    }
+
+    mm_free(mm_malloc(60000));
+    mm_malloc(48);
+    mm_malloc(48);
+    unsigned char *a = mm_malloc(48);
+    void *guard = mm_malloc(48);
+    a = mm_realloc(a, 64);
+    mm_free(mm_malloc(6000));
+    a = mm_realloc(a, 100);
+    mm_free(guard);
+    a = mm_realloc(a, 250);
+    if (a == NULL) {
+        ok = fail(check, "mm_realloc failed");
+    } else if (!mm_checkheap(__LINE__)) {
+        ok = fail(check, "the heap check fails after realloc");
+    } else {
+        fill_pattern(a, 250, 7);
+        mm_maintain(100);
+        if (!has_pattern(a, 250, 7)) {
+            ok = fail(check, "mm_maintain changed the payload");
+        } else if (!mm_checkheap(__LINE__)) {
+            ok = fail(check, "the heap check fails after mm_maintain");
+        }
+    }
+    mem_deinit();
+    return ok;
+}
+
+static void report(const char *check, bool ok, int *failures) {
+    printf("%-20s %s\n", check, ok ? "ok" : "FAILED");
+    *failures += ok ? 0 : 1;
+}
+
+int main(void) {
+    char heap_path[64];
+    char snap_path[64];
+    snprintf(heap_path, sizeof(heap_path), "/tmp/api-test-%d.heap",
+             (int)getpid());
+    snprintf(snap_path, sizeof(snap_path), "/tmp/api-test-%d.snap",
+             (int)getpid());
+
+    int failures = 0;
+    report("detach/attach", check_attach(heap_path), &failures);
+    report("snapshot/restore", check_snapshot(snap_path), &failures);
+    report("arena", check_arena(), &failures);
+    report("pool", check_pool(), &failures);
+    report("realloc headroom", check_headroom(), &failures);
+    return (failures == 0) ? 0 : 1;
+}
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -119,6 +120,14 @@ typedef struct {
     double tput; /* average throughput expressed in Kops/s */
 } sum_stats_t;
 
+/* What one process reports back to the parent during a scaling run */
+typedef struct {
+    bool valid;  /* did every trace replay without an allocator error? */
+    double ops;  /* total number of perf-weighted operations */
+    double secs; /* total number of elapsed seconds for those operations */
+    double tput; /* harmonic mean throughput over the perf traces, Kops/s */
+} scale_stats_t;
+
 /********************
  * For debugging.  If debug-mode is on, then we have each block start
  * at a "random" place (a hash of the index), and copy random data
@@ -156,6 +165,64 @@ size_t queryGlobalSpaceUsage(void);
 /* by default, no timeouts */
 static unsigned int set_timeout = 0;
 
+/* Largest process count for the throughput scaling run (-P); 0 = no run */
+static unsigned int scale_procs = 0;
+
+/* Another driver build to compare throughput against (-b), or NULL */
+static const char *compare_driver = NULL;
+
+/* Allocator options that -b passes on to the other driver, as given */
+#define FORWARDED_OPTIONS "FoIBQRZMWSG"
+static char **forward_args = NULL;
+static size_t num_forward_args = 0;
+
+/* Fit policy applied after every mm_init (-F); unset = allocator default */
+static bool fit_policy_set = false;
+static mm_fit_policy_t fit_policy = MM_FIT_GOOD;
+static unsigned int fit_k = 1;
+
+/* Free list order applied after every mm_init (-o); unset = default */
+static bool list_order_set = false;
+static mm_list_order_t list_order = MM_LIST_LIFO;
+
+/* If set, small requests use the header-free small-object region (-R) */
+static bool small_objects = false;
+
+/* If set, best fit searches the larger classes through the size index (-I) */
+static bool size_index = false;
+
+/* If set, freed small blocks go through the front cache (-Q) */
+static bool front_cache = false;
+
+/* If set, frees are buffered and carried out in address-sorted batches (-B) */
+static bool deferred_free = false;
+
+/* Calls between runs of the sampled heap checker and its cost budget in ns
+ * per call (-S); 0 = no sampled checking */
+static unsigned int check_interval = 0;
+static unsigned int check_budget_ns = 0;
+
+/* Budget of the mm_maintain slice run every MAINT_INTERVAL requests (-M);
+ * 0 = no maintenance */
+static size_t maint_budget = 0;
+#define MAINT_INTERVAL 256
+
+/* Period in ms of the background maintenance thread (-G); 0 = no thread */
+static unsigned int background_ms = 0;
+#define BACKGROUND_BUDGET 64
+
+/* Set while the thread runs on the current heap */
+static bool background_running = false;
+
+/* If set, blocks are freed with mm_free_sized (-Z) */
+static bool sized_free = false;
+
+/* If set, throughput runs write and read back every payload (-W) */
+static bool touch_payloads = false;
+
+/* Sink for payload reads, so that they are not optimized away */
+static volatile unsigned char touch_sink;
+
 /* Directory where default tracefiles are found */
 static const char default_tracedir[] = TRACEDIR;
 
@@ -204,6 +271,15 @@ static double eval_mm_util(trace_t *trace, size_t tracenum);
 static void eval_mm_speed(void *ptr);
 static double compute_scaled_score(double value, double min, double max);
 
+/* Routines for comparing throughput with another build of the driver */
+static void forward_option(int c, char *arg);
+static void compare_throughput(size_t num_tracefiles, char **tracefiles,
+                               stats_t *mm_stats);
+
+/* Routines for measuring throughput with several concurrent processes */
+static void run_scaling(size_t num_tracefiles, char **tracefiles);
+static scale_stats_t eval_mm_scaling(trace_t **traces, size_t num_traces);
+
 /* Various helper routines */
 static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats);
 static void usage(const char *prog);
@@ -216,6 +292,11 @@ static void app_error(const char *fmt, ...)
     __attribute__((format(printf, 1, 2), noreturn));
 static unsigned int atoui_or_usage(const char *arg, const char *option,
                                    const char *prog);
+static void parse_fit_policy(const char *arg, const char *prog);
+static bool init_mm(void);
+static void stop_background(void);
+static void write_payload(char *p, size_t size);
+static void read_payload(const char *p, size_t size);
 
 static sigjmp_buf timeout_jmpbuf;
 
@@ -314,6 +395,7 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
         free_range_set(ranges);
 
         /* clean up memory system */
+        stop_background();
         mem_deinit();
     }
 }
@@ -350,7 +432,11 @@ int main(int argc, char **argv) {
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "b:d:f:c:o:s:t:v:F:G:M:P:S:hpBCOVAlDIQRTWZ")) != EOF) {
+        if (strchr(FORWARDED_OPTIONS, c) != NULL) {
+            forward_option(c, optarg);
+        }
+
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -387,6 +473,10 @@ int main(int argc, char **argv) {
             }
             break;
 
+        case 'b': /* Compare throughput with another driver build */
+            compare_driver = optarg;
+            break;
+
         case 'l': /* Run libc malloc */
             run_libc = true;
             break;
@@ -411,6 +501,75 @@ int main(int argc, char **argv) {
             set_timeout = atoui_or_usage(optarg, "-s", argv[0]);
             break;
 
+        case 'F': /* Fit policy */
+            parse_fit_policy(optarg, argv[0]);
+            break;
+
+        case 'o': /* Free list order */
+            if (strcmp(optarg, "lifo") == 0) {
+                list_order = MM_LIST_LIFO;
+            } else if (strcmp(optarg, "address") == 0) {
+                list_order = MM_LIST_ADDRESS;
+            } else {
+                fprintf(stderr, "%s: invalid argument to option '-o' -- '%s'\n",
+                        argv[0], optarg);
+                usage(argv[0]);
+                exit(1);
+            }
+            list_order_set = true;
+            break;
+
+        case 'B': /* Buffer frees and carry them out in batches */
+            deferred_free = true;
+            break;
+
+        case 'I': /* Keep the best-fit size index */
+            size_index = true;
+            break;
+
+        case 'G': /* Run maintenance on a background thread */
+            background_ms = atoui_or_usage(optarg, "-G", argv[0]);
+            break;
+
+        case 'M': /* Run a maintenance slice every MAINT_INTERVAL requests */
+            maint_budget = atoui_or_usage(optarg, "-M", argv[0]);
+            break;
+
+        case 'S': /* Sampled heap checking: <interval>:<ns per call> */
+            if (sscanf(optarg, "%u:%u", &check_interval, &check_budget_ns) !=
+                    2 ||
+                check_interval == 0 || check_budget_ns == 0) {
+                fprintf(stderr, "%s: invalid argument to option '-S' -- '%s'\n",
+                        argv[0], optarg);
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
+        case 'Q': /* Keep the front cache of freed small blocks */
+            front_cache = true;
+            break;
+
+        case 'R': /* Use the small-object region */
+            small_objects = true;
+            break;
+
+        case 'W': /* Touch payloads during throughput runs */
+            touch_payloads = true;
+            break;
+
+        case 'Z': /* Pass the block size to free */
+            sized_free = true;
+            break;
+
+        case 'P': /* Throughput scaling run with up to <n> processes */
+            scale_procs = atoui_or_usage(optarg, "-P", argv[0]);
+            if (scale_procs == 0) {
+                long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+                scale_procs = ncpus > 0 ? (unsigned int)ncpus : 1;
+            }
+            break;
+
         case 'T':
             tab_mode = true;
             break;
@@ -559,6 +718,18 @@ int main(int argc, char **argv) {
                (float)(mm_sum_stats.tput / libc_sum_stats.tput));
     }
 
+#if !defined DEBUG && !defined USE_ASAN && !defined USE_MSAN
+    /* Optionally compare throughput with another build of this driver */
+    if (compare_driver != NULL && !sparse_mode && !onetime_flag) {
+        compare_throughput(num_tracefiles, tracefiles, mm_stats);
+    }
+
+    /* Optionally measure how throughput holds up under concurrent load */
+    if (scale_procs > 0 && !sparse_mode && errors == 0) {
+        run_scaling(num_tracefiles, tracefiles);
+    }
+#endif
+
     /* temporaries used to compute the performance index */
     double avg_mm_util = 0.0;
     double avg_mm_harm_throughput = 0.0;
@@ -762,6 +933,14 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
+    /* The allocator must let the caller use at least the requested size */
+    if (mm_usable_size(lo) < size) {
+        malloc_error(trace, opnum,
+                     "Payload (%p) has usable size %zu, less than %zu",
+                     (void *)lo, mm_usable_size(lo), size);
+        return false;
+    }
+
     /* If we can't afford the linear-time loop, we check less thoroughly and
        just assume the overlap will be caught by writing random bits. */
     if (debug_mode == DBG_NONE)
@@ -955,11 +1134,12 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
     bool allCheck = true;
 
     /* Reset the heap and free any records in the range list */
+    stop_background();
     mem_reset_brk();
     reinit_trace(trace);
 
     /* Call the mm package's init function */
-    if (!mm_init()) {
+    if (!init_mm()) {
         malloc_error(trace, 0, "mm_init failed");
         return false;
     }
@@ -988,6 +1168,10 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
             }
         }
 
+        if (maint_budget > 0 && i % MAINT_INTERVAL == 0) {
+            mm_maintain(maint_budget);
+        }
+
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
@@ -1074,7 +1258,11 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
                 p = trace->blocks[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            if (sized_free && p != NULL) {
+                mm_free_sized(p, trace->block_sizes[index]);
+            } else {
+                mm_free(p);
+            }
             break;
 
         default:
@@ -1109,8 +1297,9 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
     reinit_trace(trace);
 
     /* initialize the heap and the mm malloc package */
+    stop_background();
     mem_reset_brk();
-    if (!mm_init())
+    if (!init_mm())
         app_error("trace %zd: mm_init failed in eval_mm_util", tracenum);
 
     for (i = 0; i < trace->num_ops; i++) {
@@ -1162,7 +1351,11 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            if (sized_free && p != NULL) {
+                mm_free_sized(p, size);
+            } else {
+                mm_free(p);
+            }
 
             total_size -= size;
             break;
@@ -1192,12 +1385,17 @@ static void eval_mm_speed(void *ptr) {
     reinit_trace(trace);
 
     /* Reset the heap and initialize the mm package */
+    stop_background();
     mem_reset_brk();
-    if (!mm_init())
+    if (!init_mm())
         app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0; i < trace->num_ops; i++)
+    for (i = 0; i < trace->num_ops; i++) {
+        if (maint_budget > 0 && i % MAINT_INTERVAL == 0) {
+            mm_maintain(maint_budget);
+        }
+
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
@@ -1206,6 +1404,12 @@ static void eval_mm_speed(void *ptr) {
             if ((p = mm_malloc(size)) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
+            if (touch_payloads) {
+                write_payload(p, size);
+            }
+            if (touch_payloads || sized_free) {
+                trace->block_sizes[index] = size;
+            }
             break;
 
         case REALLOC: /* mm_realloc */
@@ -1217,6 +1421,12 @@ static void eval_mm_speed(void *ptr) {
                 app_error("mm_realloc error in eval_mm_speed");
             setUBCheck(true);
             trace->blocks[index] = newp;
+            if (touch_payloads) {
+                write_payload(newp, newsize);
+            }
+            if (touch_payloads || sized_free) {
+                trace->block_sizes[index] = newsize;
+            }
             break;
 
         case FREE: /* mm_free */
@@ -1225,13 +1435,303 @@ static void eval_mm_speed(void *ptr) {
                 block = 0;
             } else {
                 block = trace->blocks[index];
+                if (touch_payloads) {
+                    read_payload(block, trace->block_sizes[index]);
+                }
+            }
+            if (sized_free && block != NULL) {
+                mm_free_sized(block, trace->block_sizes[index]);
+            } else {
+                mm_free(block);
             }
-            mm_free(block);
             break;
 
         default:
             app_error("Nonexistent request type in eval_mm_speed");
         }
+    }
+}
+
+/*
+ * forward_option - Remember an allocator option, and its argument if it
+ *    has one, for compare_throughput to pass on to the other driver.
+ */
+static void forward_option(int c, char *arg) {
+    char **longer = realloc(forward_args, (num_forward_args + 2) *
+                                              sizeof(*forward_args));
+    if (longer == NULL) {
+        unix_error("realloc in forward_option failed");
+    }
+    forward_args = longer;
+    if (asprintf(&forward_args[num_forward_args++], "-%c", c) == -1) {
+        unix_error("asprintf in forward_option failed");
+    }
+    if (arg != NULL) {
+        forward_args[num_forward_args++] = arg;
+    }
+}
+
+/*
+ * compare_throughput - Run another build of the driver (for example
+ *    mdriver-pgo) over the same tracefiles in tab mode, with the same
+ *    allocator options, and print its per-trace throughput next to the
+ *    numbers measured by this binary.
+ */
+static void compare_throughput(size_t num_tracefiles, char **tracefiles,
+                               stats_t *mm_stats) {
+    double *other_tput = calloc(num_tracefiles, sizeof(double));
+    if (other_tput == NULL) {
+        unix_error("calloc in compare_throughput failed");
+    }
+
+    /* Build "<driver> -v 1 -T <options> -f <trace> -f <trace> ..." */
+    size_t nargs = 0;
+    const char **args =
+        calloc(4 + num_forward_args + 2 * num_tracefiles + 1, sizeof(*args));
+    if (args == NULL) {
+        unix_error("calloc in compare_throughput failed");
+    }
+    args[nargs++] = compare_driver;
+    args[nargs++] = "-v";
+    args[nargs++] = "1";
+    args[nargs++] = "-T";
+    for (size_t i = 0; i < num_forward_args; i++) {
+        args[nargs++] = forward_args[i];
+    }
+    for (size_t i = 0; i < num_tracefiles; i++) {
+        args[nargs++] = "-f";
+        args[nargs++] = tracefiles[i];
+    }
+    args[nargs] = NULL;
+
+    if (verbose > 1) {
+        fprintf(stderr, "\nRunning %s for comparison\n", compare_driver);
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    /* Run it directly rather than through the shell, so that no quoting
+     * is needed, and read its standard output */
+    int fds[2];
+    if (pipe(fds) == -1) {
+        unix_error("pipe in compare_throughput failed");
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        unix_error("fork in compare_throughput failed");
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        if (dup2(fds[1], STDOUT_FILENO) == -1) {
+            _exit(127);
+        }
+        close(fds[1]);
+        execvp(args[0], (char *const *)args);
+        fprintf(stderr, "Couldn't execute '%s': %s\n", compare_driver,
+                strerror(errno));
+        _exit(127);
+    }
+    close(fds[1]);
+    FILE *f = fdopen(fds[0], "r");
+    if (f == NULL) {
+        unix_error("fdopen in compare_throughput failed");
+    }
+
+    /*
+     * Per-trace lines come back in the order the traces were given and
+     * look like "1 thru? util? util ops msecs Kops/s trace", or start
+     * with "no" when the other driver found the trace invalid.
+     */
+    char buf[MAXLINE];
+    size_t trace_index = 0;
+    while (fgets(buf, MAXLINE, f) != NULL && trace_index < num_tracefiles) {
+        char *fields[8];
+        char *save = NULL;
+        size_t nfields = 0;
+        buf[strcspn(buf, "\n")] = '\0';
+        for (char *tok = strtok_r(buf, "\t", &save); tok != NULL && nfields < 8;
+             tok = strtok_r(NULL, "\t", &save)) {
+            fields[nfields++] = tok;
+        }
+        if (nfields > 0 && strcmp(fields[0], "no") == 0) {
+            trace_index++;
+        } else if (nfields == 8 && strcmp(fields[0], "1") == 0) {
+            other_tput[trace_index++] = atof(fields[6]);
+        }
+    }
+    while (getc(f) != EOF) {
+        /* drain the summary lines */
+    }
+    fclose(f);
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Warning: '%s' did not exit cleanly\n", compare_driver);
+    }
+    free(args);
+
+    printf("\nThroughput comparison with %s (Kops/sec):\n", compare_driver);
+    printf("  %9s %9s %7s  %s\n", "this", "other", "ratio", "trace");
+    double harm_this = 0.0, harm_other = 0.0;
+    int perf_weight = 0;
+    for (size_t i = 0; i < num_tracefiles; i++) {
+        if (!mm_stats[i].valid || other_tput[i] <= 0.0) {
+            printf("  %9s %9s %7s  %s\n", "-", "-", "-", tracefiles[i]);
+            continue;
+        }
+        printf("  %9.0f %9.0f %7.2f  %s\n", mm_stats[i].tput, other_tput[i],
+               other_tput[i] / mm_stats[i].tput, tracefiles[i]);
+        if (mm_stats[i].weight == WALL || mm_stats[i].weight == WPERF) {
+            harm_this += 1.0 / mm_stats[i].tput;
+            harm_other += 1.0 / other_tput[i];
+            perf_weight++;
+        }
+    }
+    if (perf_weight > 0) {
+        harm_this = perf_weight / harm_this;
+        harm_other = perf_weight / harm_other;
+        printf("  %9.0f %9.0f %7.2f  %s\n", harm_this, harm_other,
+               harm_other / harm_this, "(harmonic mean of perf traces)");
+    }
+    free(other_tput);
+}
+
+/*
+ * eval_mm_scaling - Replay every trace through eval_mm_speed inside the
+ *    calling process, which has its own memlib heap, and summarize the
+ *    perf-weighted traces the same way the main results table does.
+ */
+static scale_stats_t eval_mm_scaling(trace_t **traces, size_t num_traces) {
+    scale_stats_t stats = {.valid = true, .ops = 0, .secs = 0, .tput = 0};
+    speed_t speed_params;
+    double tput_harm = 0.0;
+    int perf_weight = 0;
+
+    for (size_t i = 0; i < num_traces; i++) {
+        if (traces[i]->weight != WALL && traces[i]->weight != WPERF) {
+            continue;
+        }
+        mem_init(false);
+        speed_params.trace = traces[i];
+        speed_params.ranges = NULL;
+        double secs = fsec(eval_mm_speed, &speed_params);
+        stop_background();
+        mem_deinit();
+
+        if (secs <= 0.0) {
+            stats.valid = false;
+            continue;
+        }
+        stats.ops += traces[i]->num_ops;
+        stats.secs += secs;
+        tput_harm += (secs * 1000.0) / traces[i]->num_ops;
+        perf_weight++;
+    }
+
+    if (perf_weight > 0 && tput_harm > 0.0) {
+        stats.tput = (double)perf_weight / tput_harm;
+    }
+    return stats;
+}
+
+/*
+ * run_scaling - Measure how much of the single-process throughput
+ *    survives when P independent processes replay the same traces at
+ *    once, for P = 1 .. scale_procs.  Each child maps its own heap, so
+ *    the allocator shares nothing between processes except the caches
+ *    and memory bandwidth of the machine.  The children are released
+ *    together by closing a pipe they are all blocked reading, and they
+ *    report their results back through a second pipe.
+ */
+static void run_scaling(size_t num_tracefiles, char **tracefiles) {
+    trace_t **traces = calloc(num_tracefiles, sizeof(trace_t *));
+    scale_stats_t *results = calloc(scale_procs, sizeof(scale_stats_t));
+    if (traces == NULL || results == NULL) {
+        unix_error("calloc in run_scaling failed");
+    }
+    for (size_t i = 0; i < num_tracefiles; i++) {
+        traces[i] = read_trace(tracefiles[i], 0);
+    }
+
+    printf("\nThroughput scaling with concurrent processes "
+           "(harmonic mean Kops/sec):\n");
+    printf("  %5s %9s %9s %9s %10s %9s\n", "procs", "min/proc", "avg/proc",
+           "max/proc", "aggregate", "per-proc");
+
+    double base_tput = 0.0;
+    for (unsigned int nprocs = 1; nprocs <= scale_procs; nprocs++) {
+        int go_fd[2], result_fd[2];
+        if (pipe(go_fd) < 0 || pipe(result_fd) < 0) {
+            unix_error("pipe in run_scaling failed");
+        }
+        fflush(stdout);
+        fflush(stderr);
+
+        for (unsigned int p = 0; p < nprocs; p++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                unix_error("fork in run_scaling failed");
+            }
+            if (pid == 0) {
+                char c;
+                close(go_fd[1]);
+                close(result_fd[0]);
+                /* Block until the parent has forked every child */
+                if (read(go_fd[0], &c, 1) < 0) {
+                    _exit(1);
+                }
+                scale_stats_t stats = eval_mm_scaling(traces, num_tracefiles);
+                if (write(result_fd[1], &stats, sizeof(stats)) !=
+                    (ssize_t)sizeof(stats)) {
+                    _exit(1);
+                }
+                _exit(0);
+            }
+        }
+
+        /* Release all children at once, then collect their reports */
+        close(go_fd[0]);
+        close(go_fd[1]);
+        close(result_fd[1]);
+        unsigned int nresults = 0;
+        while (nresults < nprocs &&
+               read(result_fd[0], &results[nresults], sizeof(scale_stats_t)) ==
+                   (ssize_t)sizeof(scale_stats_t)) {
+            nresults++;
+        }
+        close(result_fd[0]);
+        while (wait(NULL) > 0) {
+            /* reap every child */
+        }
+
+        double min_tput = DBL_MAX, max_tput = 0.0, sum_tput = 0.0;
+        bool valid = nresults == nprocs;
+        for (unsigned int p = 0; p < nresults; p++) {
+            valid = valid && results[p].valid;
+            sum_tput += results[p].tput;
+            min_tput = results[p].tput < min_tput ? results[p].tput : min_tput;
+            max_tput = results[p].tput > max_tput ? results[p].tput : max_tput;
+        }
+        if (!valid) {
+            printf("  %5u %9s %9s %9s %10s %9s\n", nprocs, "-", "-", "-", "-",
+                   "-");
+            continue;
+        }
+
+        double avg_tput = sum_tput / nprocs;
+        if (nprocs == 1) {
+            base_tput = avg_tput;
+        }
+        printf("  %5u %9.0f %9.0f %9.0f %10.0f %8.1f%%\n", nprocs, min_tput,
+               avg_tput, max_tput, sum_tput,
+               base_tput > 0.0 ? 100.0 * avg_tput / base_tput : 0.0);
+    }
+
+    for (size_t i = 0; i < num_tracefiles; i++) {
+        free_trace(traces[i]);
+    }
+    free(traces);
+    free(results);
 }
 
 /*
@@ -1703,11 +2203,119 @@ static unsigned int atoui_or_usage(const char *arg, const char *option,
     return (unsigned int)val;
 }
 
+/*
+ * parse_fit_policy - Parse the -F argument: first, next, best or good[:k]
+ */
+static void parse_fit_policy(const char *arg, const char *prog) {
+    const char *colon = strchr(arg, ':');
+    size_t len = colon != NULL ? (size_t)(colon - arg) : strlen(arg);
+    bool valid = true;
+
+    fit_k = 1;
+    if (len == 5 && strncmp(arg, "first", len) == 0) {
+        fit_policy = MM_FIT_FIRST;
+    } else if (len == 4 && strncmp(arg, "next", len) == 0) {
+        fit_policy = MM_FIT_NEXT;
+    } else if (len == 4 && strncmp(arg, "best", len) == 0) {
+        fit_policy = MM_FIT_BEST;
+    } else if (len == 4 && strncmp(arg, "good", len) == 0) {
+        fit_policy = MM_FIT_GOOD;
+        if (colon != NULL) {
+            fit_k = atoui_or_usage(colon + 1, "-F", prog);
+            colon = NULL;
+        }
+    } else {
+        valid = false;
+    }
+
+    /* Only good takes a candidate count, and it must be positive */
+    if (!valid || colon != NULL || fit_k == 0) {
+        fprintf(stderr, "%s: invalid argument to option '-F' -- '%s'\n", prog,
+                arg);
+        usage(prog);
+        exit(1);
+    }
+    fit_policy_set = true;
+}
+
+/*
+ * init_mm - Initialize the mm package and apply the -F fit policy
+ */
+static bool init_mm(void) {
+    if (!mm_init()) {
+        return false;
+    }
+    if (fit_policy_set && !mm_set_fit_policy(fit_policy, fit_k)) {
+        return false;
+    }
+    if (list_order_set && !mm_set_list_order(list_order)) {
+        return false;
+    }
+    if (small_objects && !mm_set_small_objects(true)) {
+        return false;
+    }
+    if (size_index && !mm_set_size_index(true)) {
+        return false;
+    }
+    if (front_cache && !mm_set_front_cache(true)) {
+        return false;
+    }
+    if (deferred_free && !mm_set_deferred_free(true)) {
+        return false;
+    }
+    if (check_interval > 0 &&
+        !mm_set_sampled_check(check_interval, check_budget_ns,
+                              MM_CHECK_ABORT)) {
+        return false;
+    }
+    if (background_ms > 0) {
+        if (!mm_background_start(background_ms, BACKGROUND_BUDGET)) {
+            return false;
+        }
+        background_running = true;
+    }
+    return true;
+}
+
+/*
+ * stop_background - Stop the -G maintenance thread before its heap is
+ * reset or unmapped
+ */
+static void stop_background(void) {
+    if (background_running) {
+        mm_background_stop();
+        background_running = false;
+    }
+}
+
+/*
+ * write_payload - Store to one byte in every cache line of a payload
+ */
+static void write_payload(char *p, size_t size) {
+    for (size_t off = 0; off < size; off += 64) {
+        p[off] = (char)off;
+    }
+}
+
+/*
+ * read_payload - Load one byte from every cache line of a payload
+ */
+static void read_payload(const char *p, size_t size) {
+    unsigned char sum = 0;
+    for (size_t off = 0; off < size; off += 64) {
+        sum = (unsigned char)(sum + p[off]);
+    }
+    touch_sink = sum;
+}
+
 /*
  * usage - Explain the command line arguments
  */
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr,
+            "Usage: %s [-hlVBCdDIQRW] [-b <prog>] [-F <fit>] [-M <n>] "
+            "[-o <ord>] [-P <n>] [-f <file>]\n",
+            prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
@@ -1720,6 +2328,36 @@ static void usage(const char *prog) {
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
+    fprintf(stderr, "\t-b <prog>  Compare throughput with another driver "
+                    "build, e.g. ./mdriver-pgo,\n");
+    fprintf(stderr, "\t           passing it the options -%s\n",
+            FORWARDED_OPTIONS);
+    fprintf(stderr, "\t-F <fit>   Fit policy: first, next, best or good[:k] "
+                    "(default: the allocator's),\n");
+    fprintf(stderr, "\t           for blocks the 1 KiB exact-size lists "
+                    "cannot serve\n");
+    fprintf(stderr, "\t-M <n>     Run mm_maintain(<n>) every %d requests\n",
+            MAINT_INTERVAL);
+    fprintf(stderr, "\t-G <ms>    Run mm_maintain(%d) on a background "
+                    "thread every <ms> (mdriver-bg)\n",
+            BACKGROUND_BUDGET);
+    fprintf(stderr, "\t-S <n>:<ns> Check a slice of the heap every <n> "
+                    "calls, within <ns> per call\n");
+    fprintf(stderr, "\t-o <ord>   Free list order: lifo or address\n");
+    fprintf(stderr, "\t-I         Keep a size index of the larger free "
+                    "blocks for best fit\n");
+    fprintf(stderr, "\t-B         Buffer frees and coalesce them in "
+                    "address-sorted batches\n");
+    fprintf(stderr, "\t-Q         Keep freed small blocks in a front "
+                    "cache for reuse\n");
+    fprintf(stderr, "\t-R         Serve small requests from the header-free "
+                    "small-object region\n");
+    fprintf(stderr, "\t-W         Write and read back payloads when "
+                    "measuring throughput\n");
+    fprintf(stderr, "\t-Z         Free blocks with mm_free_sized (saves the "
+                    "header read with -Q or -B)\n");
+    fprintf(stderr, "\t-P <n>     Also measure throughput with 1..n concurrent "
+                    "processes (0 = #cores)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
 }
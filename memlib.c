@@ -42,6 +42,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #ifdef USE_ASAN
@@ -64,6 +65,17 @@ typedef struct MBLK {
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* Header page at the start of a file that holds a heap */
+typedef struct {
+    uint64_t magic;  /* MEM_FILE_MAGIC */
+    uint64_t base;   /* Address the heap was mapped at */
+    uint64_t length; /* Bytes of heap the file has room for */
+    uint64_t brk;    /* Bytes of heap in use */
+    unsigned char area[]; /* Rest of the page, see mem_file_area */
+} mem_file_header_t;
+
+#define MEM_FILE_MAGIC 0x6d656d6c69626831UL /* "memlibh1" */
+
 /* private global variables */
 static bool sparse = false;    /* Use sparse memory emulation */
 static unsigned char *heap;    /* Starting address of heap */
@@ -78,6 +90,10 @@ static bool show_stats =
 static bool stats_printed =
     false; /* Has information been printed about allocation */
 
+/* File-backed heap (mem_init_file) */
+static int heap_fd = -1;                     /* The file, or -1 */
+static mem_file_header_t *file_header = NULL; /* Its header page */
+
 /* Sparse memory representation */
 static mem_block_t *next_free_page = NULL; /* Next free page */
 static size_t num_pages = 0;               /* Total number of pages */
@@ -143,6 +159,34 @@ static inline void *round_address_up(void *addr, size_t align) {
     return (void *)(((uintptr_t)addr + align - 1) & ~(align - 1));
 }
 
+/**
+ * Count the resident pages in a page-aligned range.
+ * @param lo  The start of the range.
+ * @param hi  The end of the range.
+ * @return The bytes of the pages in [lo, hi) that are backed by memory;
+ *         pages mincore cannot report on count as resident.
+ */
+static size_t resident_bytes(unsigned char *lo, unsigned char *hi) {
+    size_t page = mem_pagesize();
+    unsigned char vec[256];
+    size_t resident = 0;
+
+    while (lo < hi) {
+        size_t pages = (size_t)(hi - lo) / page;
+        if (pages > sizeof(vec)) {
+            pages = sizeof(vec);
+        }
+        if (mincore(lo, pages * page, vec) == -1) {
+            return resident + (size_t)(hi - lo);
+        }
+        for (size_t i = 0; i < pages; i++) {
+            resident += (vec[i] & 1) ? page : 0;
+        }
+        lo += pages * page;
+    }
+    return resident;
+}
+
 /*
  * mem_init - initialize the memory system model
  */
@@ -209,12 +253,130 @@ void mem_init(bool do_sparse) {
     mem_brk_chunk = heap;
 }
 
+/*
+ * mem_init_file - initialize the memory system model with a dense heap
+ *     kept in a file.  The file is mapped shared, a header page followed by
+ *     the heap, at the same address in every process, so pointers stored
+ *     in the heap stay valid when a later process maps it again.  A new
+ *     (empty or missing) file starts an empty heap; otherwise the heap and
+ *     its break are taken up where the last process left them.
+ */
+bool mem_init_file(const char *path) {
+    size_t pagesize = mem_pagesize();
+    size_t length = pagesize + MAX_DENSE_HEAP;
+    unsigned char *base = (unsigned char *)TRY_DENSE_HEAP_START - pagesize;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "ERROR: opening heap file '%s' failed (%s)\n", path,
+                strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+
+    bool fresh = (st.st_size == 0);
+    if (fresh ? ftruncate(fd, (off_t)length) == -1
+              : st.st_size != (off_t)length) {
+        fprintf(stderr, "ERROR: '%s' is not a heap file of %zu bytes\n", path,
+                length);
+        close(fd);
+        return false;
+    }
+
+    /* The heap must land exactly where it was, so never move or replace */
+    void *addr = mmap(base, length, PROT_NONE, MAP_SHARED | MAP_FIXED_NOREPLACE,
+                      fd, 0);
+    if (addr != base) {
+        fprintf(stderr, "ERROR: mapping heap file '%s' at %p failed (%s)\n",
+                path, (void *)base,
+                addr == MAP_FAILED ? strerror(errno) : "address taken");
+        if (addr != MAP_FAILED) {
+            munmap(addr, length);
+        }
+        close(fd);
+        return false;
+    }
+
+    mem_file_header_t *header = (mem_file_header_t *)base;
+    if (mprotect(base, pagesize, PROT_READ | PROT_WRITE) == -1) {
+        goto fail;
+    }
+    if (fresh) {
+        header->magic = MEM_FILE_MAGIC;
+        header->base = (uint64_t)(uintptr_t)base;
+        header->length = MAX_DENSE_HEAP;
+        header->brk = 0;
+    } else if (header->magic != MEM_FILE_MAGIC ||
+               header->base != (uint64_t)(uintptr_t)base ||
+               header->length != MAX_DENSE_HEAP ||
+               header->brk > MAX_DENSE_HEAP) {
+        fprintf(stderr, "ERROR: '%s' has a bad heap header\n", path);
+        goto fail;
+    }
+
+    sparse = false;
+    next_free_page = NULL;
+    num_pages = 0;
+    page_table = NULL;
+    num_buckets = 0;
+    mmap_length = length;
+    heap = base + pagesize;
+    mem_max_addr = heap + MAX_DENSE_HEAP;
+    mem_brk = heap + header->brk;
+    mem_brk_chunk = round_address_up(mem_brk, pagesize);
+    stats_printed = false;
+
+    /* Make the part of the heap already in use accessible again */
+    if (mem_brk_chunk > heap &&
+        mprotect(heap, (size_t)(mem_brk_chunk - heap),
+                 PROT_READ | PROT_WRITE) == -1) {
+        goto fail;
+    }
+
+    heap_fd = fd;
+    file_header = header;
+    return true;
+
+fail:
+    munmap(base, length);
+    close(fd);
+    return false;
+}
+
+/*
+ * mem_file_area - return the spare bytes of the header page of a heap
+ *     file, which the allocator can keep its list roots in, and their
+ *     number; NULL if the heap is not kept in a file.  They are zero in a
+ *     new file.
+ */
+void *mem_file_area(size_t *len) {
+    if (file_header == NULL) {
+        *len = 0;
+        return NULL;
+    }
+    *len = mem_pagesize() - sizeof(mem_file_header_t);
+    return file_header->area;
+}
+
 /*
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void) {
     print_stats();
-    munmap(heap, mmap_length);
+    if (heap_fd != -1) {
+        /* Write the heap back to the file before letting go of it */
+        msync(file_header, (size_t)(mem_brk_chunk - (unsigned char *)file_header),
+              MS_SYNC);
+        munmap(file_header, mmap_length);
+        close(heap_fd);
+        heap_fd = -1;
+        file_header = NULL;
+    } else {
+        munmap(heap, mmap_length);
+    }
     next_free_page = NULL;
     num_free_pages = 0;
     page_table = NULL;
@@ -233,6 +395,17 @@ void mem_reset_brk(void) {
         /* First page is just beyond page table */
         next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
         num_free_pages = num_pages;
+    } else if (heap_fd != -1) {
+        /* Empty the heap part of the file, which keeps it mapped */
+        size_t pagesize = mem_pagesize();
+        if (ftruncate(heap_fd, (off_t)pagesize) == -1 ||
+            ftruncate(heap_fd, (off_t)mmap_length) == -1 ||
+            mprotect(heap, MAX_DENSE_HEAP, PROT_NONE) == -1) {
+            fprintf(stderr, "FAILURE.  emptying heap file failed (%s)\n",
+                    strerror(errno));
+            exit(1);
+        }
+        file_header->brk = 0;
     } else {
         /* In order to make subsequent calls to mem_sbrk cost
            approximately what they did on the first pass, overwrite
@@ -311,9 +484,103 @@ void *mem_sbrk(intptr_t incr) {
 
     mem_brk_chunk = new_brk_chunk;
     mem_brk = new_brk;
+    if (file_header != NULL) {
+        file_header->brk = (uint64_t)(new_brk - heap);
+    }
     return old_brk;
 }
 
+/*
+ * mem_purge - give the whole pages in [addr, addr + len) back to the
+ *     system, which refills them with zeros if they are touched again.
+ *     Returns the number of resident bytes given back, so that purging a
+ *     range twice counts its pages once; the sparse emulation has no
+ *     pages of its own to give back, so it always returns 0.
+ */
+size_t mem_purge(void *addr, size_t len) {
+    if (sparse || len == 0) {
+        return 0;
+    }
+
+    unsigned char *lo = round_address_up(addr, mem_pagesize());
+    unsigned char *hi =
+        round_address_down((unsigned char *)addr + len, mem_pagesize());
+    if (hi <= lo) {
+        return 0;
+    }
+
+    /* Pages that were never touched or were purged before cost nothing */
+    size_t released = resident_bytes(lo, hi);
+    if (released == 0) {
+        return 0;
+    }
+
+    if (heap_fd != -1) {
+        /* Dropping shared pages would only reload them from the file */
+        off_t offset = (off_t)(lo - (unsigned char *)file_header);
+        if (fallocate(heap_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      offset, (off_t)(hi - lo)) == -1) {
+            return 0;
+        }
+    } else if (madvise(lo, (size_t)(hi - lo), MADV_DONTNEED) == -1) {
+        return 0;
+    }
+#ifdef USE_MSAN
+    /* The zeros the pages come back with count as uninitialized */
+    __msan_allocated_memory(lo, (size_t)(hi - lo));
+#endif
+
+    return released;
+}
+
+/*
+ * mem_remap - copy len bytes from src to dst like mem_memcpy, leaving the
+ *     contents of src undefined.  When the two ranges sit at the same offset
+ *     within a page, the whole pages between them are moved with mremap
+ *     instead of copied, and src gets fresh zero pages in their place.  The
+ *     sparse emulation has no pages to move, and a heap kept in a file must
+ *     keep its pages at their file offsets, so those always copy.
+ */
+void *mem_remap(void *dst, void *src, size_t len) {
+    size_t pagesize = mem_pagesize();
+    unsigned char *lo = round_address_up(src, pagesize);
+    unsigned char *hi =
+        round_address_down((unsigned char *)src + len, pagesize);
+    ptrdiff_t delta = (unsigned char *)dst - (unsigned char *)src;
+
+    /* Pages of a heap file must stay at their offsets in the file */
+    if (sparse || heap_fd != -1 || hi <= lo ||
+        ((size_t)delta & (pagesize - 1)) != 0) {
+        return mem_memcpy(dst, src, len);
+    }
+
+    size_t head = (size_t)(lo - (unsigned char *)src);
+    size_t middle = (size_t)(hi - lo);
+#ifdef USE_MSAN
+    /* The shadow stays where it is, so move it along with the pages */
+    __msan_copy_shadow(lo + delta, lo, middle);
+#endif
+    if (mremap(lo, middle, middle, MREMAP_MAYMOVE | MREMAP_FIXED,
+               lo + delta) == MAP_FAILED) {
+        /* Out of mappings, most likely: fall back to copying */
+        return mem_memcpy(dst, src, len);
+    }
+    /* Fill the hole the pages left so the heap stays contiguous */
+    if (mmap(lo, middle, PROT_READ | PROT_WRITE,
+             MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
+        fprintf(stderr, "FAILURE.  refilling %zu heap bytes at %p failed (%s)\n",
+                middle, (void *)lo, strerror(errno));
+        exit(1);
+    }
+#ifdef USE_MSAN
+    __msan_allocated_memory(lo, middle);
+#endif
+
+    memcpy(dst, src, head);
+    memcpy(hi + delta, hi, (size_t)((unsigned char *)src + len - hi));
+    return dst;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -12,12 +12,43 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * @brief
  * @param[in] sparse
  */
 void mem_init(bool sparse);
 
+/**
+ * @brief Initializes the memory model with a dense heap kept in a file.
+ *
+ * The file is mapped shared at a fixed address, with a header page that
+ * records the break ahead of the heap, so a heap built by one process can
+ * be mapped again by the next one with every pointer in it still valid
+ * (see mm_detach and mm_attach).  A missing or empty file is created as an
+ * empty heap.  mem_reset_brk empties the file; mem_deinit writes it back.
+ *
+ * @param[in] path The heap file
+ * @return true on success, and false if the file cannot be opened, is not
+ *         a heap file, or its address is taken
+ */
+bool mem_init_file(const char *path);
+
+/**
+ * @brief Finds the spare bytes of the header page of a heap file.
+ *
+ * The allocator keeps what it needs to reopen the heap there, such as its
+ * free list roots, outside the heap proper.  They are zero in a new file
+ * and persist with it.
+ *
+ * @param[out] len The number of spare bytes
+ * @return The spare bytes, or NULL if the heap is not kept in a file
+ */
+void *mem_file_area(size_t *len);
+
 /**
  * @brief
  */
@@ -36,6 +67,35 @@ void mem_deinit(void);
  */
 void *mem_sbrk(intptr_t incr);
 
+/**
+ * @brief Gives the whole pages within a heap range back to the system.
+ *
+ * The range stays part of the heap: its pages read as zero the next time
+ * they are touched. The sparse emulation keeps its pages, so there this
+ * does nothing.
+ *
+ * @param[in] addr The start of the range
+ * @param[in] len  The length of the range, in bytes
+ * @return The number of bytes given back that were resident before
+ */
+size_t mem_purge(void *addr, size_t len);
+
+/**
+ * @brief Copies len bytes of the heap from src to dst, moving whole pages
+ * rather than copying them where it can.
+ *
+ * Pages are moved when dst and src have the same offset within a page; the
+ * pages left behind in src read as zero. The ranges must not overlap, and
+ * the contents of src are undefined afterwards. The sparse emulation and a
+ * heap kept in a file always copy.
+ *
+ * @param[in] dst The destination, in the heap
+ * @param[in] src The source, in the heap
+ * @param[in] len The number of bytes to move
+ * @return dst
+ */
+void *mem_remap(void *dst, void *src, size_t len);
+
 /**
  * @brief Resets the simulated brk pointer to make an empty heap.
  */
@@ -134,4 +194,8 @@ void hprobe(void *ptr, int offset, size_t count);
  */
 void setUBCheck(bool);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* memlib.h */
@@ -11,24 +11,30 @@
  * For each mini block, it contains a header and a pointer to the next mini
  * block.
  *
- * The size of the block is packed in its header with the four least-significant
- * bits set to zero, as the result of 16-byte alignment. The least significant
- * bit of the header is set to indicate the block allocation status. The second
- * to least significant bit is set to indicate the allocation status of the 
- * previous block. The third to least significant bit is set to indicate the 
- * mini status of the previous block.
+ * The size of the block is packed in its header with the four least
+ * significant bits set to zero, as the result of 16-byte alignment. Bit 0x1
+ * holds the allocation status of the block, 0x2 that of the previous block,
+ * and 0x4 whether the previous block is a mini block. Bit 0x8 marks an
+ * allocated block that realloc has grown, so that growing it again reserves
+ * headroom, and a free block whose pages mm_maintain has given back; writing
+ * the header clears it.
  *
  * The payload area is implementated using union and contains both the users'
  * data and two pointers pointing to the previous and next blocks, respectively.
  * Thus, each free list is a non-circular double-linked list that allows
- * traverse between adjacent free blocks.
+ * traverse between adjacent free blocks. With MM_COMPACT_LINKS the links are
+ * 32-bit offsets, so mini blocks fit both and sit in seg_list[0] instead of
+ * the mini-block list.
  *
  * The segregated list is an array of explicit lists partitioned according to
- * different block sizes. There are in total 14 buckets in this segregated list.
- * The first bucket contains all blocks with sizes smaller or equal to 2^5, 
- * and the following buckets are classified according the powers of 2. This 
- * implementation uses the LIFO strategy to insert and remove any block in the 
- * current free list.
+ * different block sizes. Blocks of up to MM_EXACT_MAX (1 KiB) have an
+ * exact-size list for every multiple of 16 bytes, and larger ones share the
+ * wider classes of MM_CLASS_BOUNDS. A bitmap of the non-empty lists lets
+ * find_fit go straight to the smallest class that can hold a request. Freed
+ * blocks go to the head of their list by default, or into address order
+ * (see mm_set_list_order); the mini-block list is always LIFO. The free block
+ * next to the epilogue, the wilderness, is kept out of the lists, and
+ * requests no list can serve are carved from its front.
  *
  * The program also uses the mm_checkheap function to track the heap performance
  * and check for invariants.
@@ -41,6 +47,7 @@
  *
  */
 
+#define _GNU_SOURCE 1 // for PTHREAD_MUTEX_RECURSIVE with MM_BACKGROUND
 #include <assert.h>
 #include <inttypes.h>
 #include <stdbool.h>
@@ -48,13 +55,190 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "memlib.h"
 #include "mm.h"
 
+/*
+ * Tunable parameters.  The defaults below were picked by hand on the
+ * course traces; each one can be overridden on the compiler command line
+ * or from a header written by tune.pl (see MM_CONFIG in the Makefile).
+ */
+
+/* Largest block size with a free list of its own, a multiple of 16; every
+ * block size from 16 up to it is a class */
+#ifndef MM_EXACT_MAX
+#define MM_EXACT_MAX 1024
+#endif
+
+/* Exclusive upper bounds of every larger segregated class except the last.
+ * Bounds up to MM_EXACT_MAX leave their classes empty. */
+#ifndef MM_CLASS_BOUNDS
+#define MM_CLASS_BOUNDS 2048, 3072, 4096, 6656, 8192, 16384, 32768
+#endif
+
+/* Bytes requested from mem_sbrk when no free block fits */
+#ifndef MM_CHUNKSIZE
+#define MM_CHUNKSIZE (1 << 12)
+#endif
+
+/* Fitting candidates that fail to beat the best so far before find_fit
+ * settles for it */
+#ifndef MM_FIT_PATIENCE
+#define MM_FIT_PATIENCE 1
+#endif
+
+/* Fit policy mm_init selects (see mm_set_fit_policy) */
+#ifndef MM_FIT_POLICY
+#define MM_FIT_POLICY MM_FIT_GOOD
+#endif
+
+/* Requests of at least this many bytes are placed at the back of the free
+ * block they are split from, and smaller ones at the front */
+#ifndef MM_SPLIT_THRESHOLD
+#define MM_SPLIT_THRESHOLD 256
+#endif
+
+/* Bytes an arena requests from the heap for each regular chunk */
+#ifndef MM_ARENA_CHUNKSIZE
+#define MM_ARENA_CHUNKSIZE (1 << 12)
+#endif
+
+/* Heap model: 1 stores free-list links as 32-bit offsets from heap_start
+ * in units of 16 bytes, which limits the heap to 64 GiB but lets mini
+ * blocks be doubly linked in seg_list[0] like every other free block.
+ * extend_heap fails past that limit, so the giant traces cannot run. */
+#ifndef MM_COMPACT_LINKS
+#define MM_COMPACT_LINKS 0
+#endif
+
+/* Whether mm_init enables the small-object region (see
+ * mm_set_small_objects) */
+#ifndef MM_SMALL_OBJECTS
+#define MM_SMALL_OBJECTS false
+#endif
+
+/* Largest request served from the small-object region, a multiple of 16 */
+#ifndef MM_SMALL_MAX
+#define MM_SMALL_MAX 64
+#endif
+
+/* Size of a small-object page; a power of two, at most 32 KiB */
+#ifndef MM_SMALL_PAGESIZE
+#define MM_SMALL_PAGESIZE (1 << 10)
+#endif
+
+/* Pages in the small-object region */
+#ifndef MM_SMALL_PAGES
+#define MM_SMALL_PAGES 16
+#endif
+
+// Slot sizes in the small-object region: 16, 32, ..., MM_SMALL_MAX
+#define SMALL_CLASSES (MM_SMALL_MAX / 16)
+
+// Most slots a small-object page can hold, and the bitmap words covering them
+#define SMALL_SLOTS (MM_SMALL_PAGESIZE / 16)
+#define SMALL_MAP_WORDS ((SMALL_SLOTS + 63) / 64)
+
+/* Free list order mm_init selects (see mm_set_list_order) */
+#ifndef MM_LIST_ORDER
+#define MM_LIST_ORDER MM_LIST_LIFO
+#endif
+
+/* Blocks after a freed one that address-ordered insertion inspects for its
+ * list successor before falling back to walking the list */
+#ifndef MM_ORDER_LOOKAHEAD
+#define MM_ORDER_LOOKAHEAD 16
+#endif
+
+/* Classes whose blocks are all at least this large are covered by the size
+ * index (see mm_set_size_index); exact-size classes never are, since any of
+ * their blocks is a best fit */
+#ifndef MM_SIZE_INDEX_MIN
+#define MM_SIZE_INDEX_MIN 512
+#endif
+
+/* Free blocks a class needs before the size index allocates entries for
+ * it; shorter lists are walked. The entries double each time the class
+ * outgrows them */
+#ifndef MM_SIZE_INDEX_INIT
+#define MM_SIZE_INDEX_INIT 16
+#endif
+
+/* Whether mm_init enables the front cache (see mm_set_front_cache) */
+#ifndef MM_FRONT_CACHE
+#define MM_FRONT_CACHE false
+#endif
+
+/* Largest block size the front cache keeps, a multiple of 16 */
+#ifndef MM_CACHE_MAX
+#define MM_CACHE_MAX 256
+#endif
+
+/* Blocks the front cache keeps per size */
+#ifndef MM_CACHE_DEPTH
+#define MM_CACHE_DEPTH 8
+#endif
+
+// Block sizes in the front cache: 16, 32, ..., MM_CACHE_MAX
+#define CACHE_BINS (MM_CACHE_MAX / 16)
+
+/* Whether mm_init enables the free buffer (see mm_set_deferred_free) */
+#ifndef MM_DEFER_FREES
+#define MM_DEFER_FREES false
+#endif
+
+/* Frees the free buffer holds before it carries them out in one batch */
+#ifndef MM_FREE_BUFFER
+#define MM_FREE_BUFFER 64
+#endif
+
+/* Smallest free block whose pages mm_maintain gives back to the system */
+#ifndef MM_PURGE_MIN
+#define MM_PURGE_MIN (1 << 16)
+#endif
+
+/* 1 builds the background maintenance thread (mm_background_start), which
+ * needs -pthread; 0 leaves calling mm_maintain to the application */
+#ifndef MM_BACKGROUND
+#define MM_BACKGROUND 0
+#endif
+
+/* Smallest payload that mm_realloc grows by moving its pages to the end of
+ * the heap (see mem_remap) rather than by copying it */
+#ifndef MM_REMAP_MIN
+#define MM_REMAP_MIN (1 << 20)
+#endif
+
+/* Headroom mm_realloc reserves when it grows a block that it has grown
+ * before, in percent of the new size; 0 turns it off */
+#ifndef MM_REALLOC_HEADROOM
+#define MM_REALLOC_HEADROOM 50
+#endif
+
+/* Blocks that can hold realloc headroom at once; each new one takes the
+ * headroom back from the oldest */
+#ifndef MM_HEADROOM_SLOTS
+#define MM_HEADROOM_SLOTS 8
+#endif
+
+#if MM_BACKGROUND
+#include <pthread.h>
+#endif
+
+/** @brief Size class boundaries, in bytes */
+static const size_t class_bounds[] = {MM_CLASS_BOUNDS};
+
+// Exact-size classes: blocks of 16, 32, ..., MM_EXACT_MAX bytes
+#define EXACT_BINS (MM_EXACT_MAX / 16)
+
 // Optimal segregated list length
-#define LENGTH 14
+#define LENGTH (EXACT_BINS + sizeof(class_bounds) / sizeof(class_bounds[0]) + 1)
+
+// Words of the bitmap of non-empty classes
+#define MAP_WORDS ((LENGTH + 63) / 64)
 
 /* Do not change the following! */
 
@@ -124,7 +308,25 @@ static const size_t min_block_size = dsize;
  * block extended in the heap
  * (Must be divisible by dsize)
  */
-static const size_t chunksize = (1 << 12);
+static const size_t chunksize = MM_CHUNKSIZE;
+
+/**
+ * @brief Size from which split_block_back places requests at the back of a
+ * free block, so that large and small objects grow apart
+ */
+static const size_t split_threshold = MM_SPLIT_THRESHOLD;
+
+/**
+ * @brief Size of a regular arena chunk, chosen so that the heap block
+ * holding it is exactly MM_ARENA_CHUNKSIZE bytes
+ */
+static const size_t arena_chunksize = MM_ARENA_CHUNKSIZE - sizeof(word_t);
+
+/**
+ * @brief Number of fitting blocks no smaller than the current best that
+ * find_fit tolerates in a class before returning the best
+ */
+static const unsigned int fit_patience = MM_FIT_PATIENCE;
 
 /**
  * @brief Indicator of the block allocation status
@@ -141,6 +343,19 @@ static const word_t prev_alloc_mask = 0x2;
  */
 static const word_t prev_mini_mask = 0x4;
 
+/**
+ * @brief Indicator of an allocated block that realloc has grown, so that
+ * growing it again reserves headroom. Writing the header clears it.
+ */
+static const word_t grown_mask = 0x8;
+
+/**
+ * @brief Indicator of a free block whose pages mm_maintain has given back
+ * since it was freed, which is the same bit as grown_mask on allocated
+ * blocks. Writing the header clears it.
+ */
+static const word_t purged_mask = 0x8;
+
 /**
  * @brief Indicator of the block size
  */
@@ -150,10 +365,17 @@ static const word_t size_mask = ~(word_t)0xF;
 typedef struct block {
     word_t header;
     union {
+#if MM_COMPACT_LINKS
+        struct {
+            uint32_t prev; // Offset link, see block_to_link
+            uint32_t next;
+        };
+#else
         struct {
             struct block *prev;
             struct block *next;
         };
+#endif
         char data[0];
     } payload;
 } block_t;
@@ -164,16 +386,219 @@ typedef struct mini_block {
     struct mini_block *next;
 } mini_block_t;
 
+/**
+ * @brief Metadata of one page of the small-object region. It lives in the
+ * region header rather than in the page, which holds nothing but slots of
+ * one size: overrunning a slot cannot reach allocator state, and free finds
+ * the metadata from the page's index in the region.
+ */
+typedef struct small_page {
+    struct small_page *prev;  // Neighbours in the partial or empty page list
+    struct small_page *next;
+    uint16_t slot_size;       // Size of every slot in the page
+    uint16_t slots;           // Number of slots that fit in the page
+    uint16_t used;            // Number of slots allocated
+    uint16_t class;           // Index of the page's list in partial
+    uint64_t map[SMALL_MAP_WORDS]; // Bit i set if slot i is allocated or
+                                   // past the last slot
+} small_page_t;
+
+/**
+ * @brief The small-object region: MM_SMALL_PAGES aligned pages carved from
+ * one heap block, with this header, the metadata of every page included, in
+ * the alignment slack before them
+ */
+typedef struct {
+    small_page_t *partial[SMALL_CLASSES]; // Pages with a free slot, per size
+    small_page_t *empty;                  // Pages with no slot allocated
+    char *pages;                          // First page
+    size_t next_page;                     // Index of the first unused page
+    small_page_t meta[MM_SMALL_PAGES];    // Metadata of each page, in order
+} small_region_t;
+
+/**
+ * @brief Side index of the free blocks in the larger classes, for best fit.
+ * Each class keeps the sizes of its blocks in a dense array, so a search
+ * scans a few cache lines instead of loading one header per candidate. A
+ * free block records its entry in the third word of its payload.
+ */
+typedef struct {
+    size_t first;             // First class covered
+    size_t *sizes[LENGTH];    // Sizes of the free blocks, per class
+    block_t **blocks[LENGTH]; // The blocks those sizes belong to
+    uint32_t length[LENGTH];  // Free blocks, per class
+    uint32_t count[LENGTH];   // Entries in use, per class
+    uint32_t cap[LENGTH];     // Entries allocated, per class
+    bool overflow[LENGTH];    // Class has blocks without an entry
+    bool wanted[LENGTH];      // Overflowed class a search walked
+    bool pending;             // Some class is wanted
+    bool growing;             // index_prepare is running
+} size_index_t;
+
+/**
+ * @brief Front cache of recently freed blocks, one LIFO stack per size.
+ * Cached blocks stay marked allocated and are linked through their first
+ * payload word, so a hit skips coalescing and the segregated lists alike.
+ * There is one cache per heap, not one per CPU: only the application
+ * thread allocates, and the maintenance thread flushes the cache under the
+ * same heap lock, so the bins never see two writers at once.
+ */
+typedef struct {
+    block_t *bins[CACHE_BINS];   // Cached blocks of 16 * (i + 1) bytes
+    uint8_t count[CACHE_BINS];   // Blocks in each bin
+} front_cache_t;
+
+/**
+ * @brief Buffer of frees not carried out yet. Buffered blocks stay marked
+ * allocated until buffer_flush sorts them by address and frees every run
+ * of adjacent ones as a single block.
+ */
+typedef struct {
+    block_t *blocks[MM_FREE_BUFFER]; // Buffered blocks, in order of free
+    size_t count;                    // Blocks in the buffer
+} free_buffer_t;
+
+/**
+ * @brief Allocated blocks that realloc gave room to grow into, each with
+ * the size its last resize asked for. The table is a ring: a new entry
+ * takes the headroom back from the oldest.
+ */
+typedef struct {
+    block_t *blocks[MM_HEADROOM_SLOTS]; // Blocks with headroom, or NULL
+    size_t need[MM_HEADROOM_SLOTS];     // Size each block's data needs
+    size_t next;                        // Entry the next block replaces
+} headroom_t;
+
+/**
+ * @brief State of the sampled heap checker (see mm_set_sampled_check): how
+ * often it runs, how much one run can afford, and what it has found
+ */
+typedef struct {
+    uint64_t rng;          // xorshift64 state for picking where to look
+    uint32_t interval;     // Operations between runs
+    uint32_t budget_ns;    // Average cost allowed per operation
+    uint32_t slice;        // Blocks and list nodes one run inspects
+    uint32_t countdown;    // Operations left until the next run
+    uint8_t action;        // mm_check_action_t
+    bool quarantined;      // A run found corruption and quarantined the heap
+    mm_check_stats_t stats;
+} sampler_t;
+
+#if MM_BACKGROUND
+/** @brief The background maintenance thread, and the heap lock it shares */
+typedef struct {
+    pthread_mutex_t lock;   // Recursive; held by every entry point
+    pthread_cond_t wake;    // Signalled on heap growth or mm_background_wake
+    pthread_t thread;
+    unsigned int period_ms; // Time between slices when nothing signals
+    size_t budget;          // Budget of each mm_maintain slice
+    bool stop;              // Makes the thread exit
+} background_t;
+#endif
+
+/**
+ * @brief Per-heap allocator state.  It lives at the low end of the heap,
+ * ahead of the prologue, so that it costs no global data.  The alignment
+ * keeps its size a multiple of dsize, so payloads stay aligned.
+ */
+typedef struct {
+    _Alignas(16) block_t *rover; // Where the next MM_FIT_NEXT search resumes
+    block_t *lists[LENGTH]; // Heads of the segregated lists, see seg_list
+    block_t *finger;   // Last block inserted in address order, or NULL
+    block_t *wilderness; // Free block next to the epilogue, or NULL
+    small_region_t *small; // Small-object region, or NULL until first used
+    size_index_t *index; // Best-fit size index, or NULL when disabled
+    front_cache_t *cache; // Front cache, or NULL when disabled
+    free_buffer_t *buffer; // Free buffer, or NULL when disabled
+    sampler_t *sampler; // Sampled checker, or NULL when disabled
+    headroom_t *headroom; // Blocks with realloc headroom, or NULL
+#if MM_BACKGROUND
+    background_t *bg;  // Maintenance thread, or NULL when not running
+#endif
+    mm_maint_stats_t maint; // Work done by mm_maintain
+    uint16_t policy;   // mm_fit_policy_t
+    uint16_t order;    // mm_list_order_t
+    uint32_t patience; // Non-improving candidates MM_FIT_GOOD tolerates
+    uint16_t purge_class; // Class the next mm_maintain slice purges first
+    bool small_objects; // Whether small requests go to the region
+} heap_state_t;
+
+/**
+ * @brief What mm_detach saves in the header page of a heap file (see
+ * mem_file_area) for mm_attach to reopen the heap from: the roots that
+ * live in global variables while the heap is in use, and the application's
+ * own root. The heads of the segregated lists are in the heap state.
+ */
+typedef struct {
+    uint64_t magic;   // heap_magic while the roots are current
+    uint64_t layout;  // heap_layout() of the build that saved them
+    void *root;       // See mm_set_root
+#if !MM_COMPACT_LINKS
+    mini_block_t *mini_list;
+#endif
+} heap_roots_t;
+
+/**
+ * @brief Start of a snapshot file (see mm_snapshot). The used parts of the
+ * heap follow as extents: an offset from the base and a length, each a
+ * word, then that many bytes.
+ */
+typedef struct {
+    uint64_t magic;  // snapshot_magic
+    uint64_t layout; // heap_layout() of the build that wrote it
+    uint64_t base;   // mem_heap_lo() of the heap
+    uint64_t size;   // mem_heapsize() of the heap
+#if !MM_COMPACT_LINKS
+    mini_block_t *mini_list;
+#endif
+} snapshot_header_t;
+
+/** @brief Header of one chunk of memory owned by an arena or a pool */
+typedef struct chunk {
+    struct chunk *next; // Next older chunk of the owner, or NULL
+    size_t size;        // Size of the chunk, header included
+    char data[0];       // Start of the bump-allocated space
+} chunk_t;
+
+/** @brief An arena: a bump allocator over chunks taken from the heap */
+struct mm_arena {
+    chunk_t *chunks; // Chunks, newest first
+    char *cur;       // Next free byte in the newest regular chunk
+    char *end;       // End of the newest regular chunk
+};
+
+/** @brief A pool of fixed-size objects carved from slabs on the heap */
+struct mm_pool {
+    size_t stride;  // Bytes per object, a multiple of the alignment
+    size_t align;   // Alignment of every object
+    void *free_obj; // Freed objects, linked through their first word
+    chunk_t *slabs; // Slabs, newest first
+    char *cur;      // Next never-used object in the newest slab
+    char *end;      // End of the newest slab
+};
+
+/** @brief Marks saved roots that match the heap, see heap_roots_t */
+static const uint64_t heap_magic = 0x6d6d2d6865617031; // "mm-heap1"
+
+/** @brief Marks a snapshot file, see snapshot_header_t */
+static const uint64_t snapshot_magic = 0x6d6d2d736e617031; // "mm-snap1"
+
 /* Global variables */
 
 /** @brief Pointer to first block in the heap */
 static block_t *heap_start = NULL;
 
-/** @brief Desired segregated list as the partitioned form of explicit lists*/
-static block_t *seg_list[LENGTH];
+/** @brief Desired segregated list as the partitioned form of explicit lists,
+ * kept in the heap state to leave room for the exact-size classes */
+static block_t **seg_list;
 
+/** @brief Bit i set if seg_list[i] is not empty */
+static uint64_t list_map[MAP_WORDS];
+
+#if !MM_COMPACT_LINKS
 /** @brief List of blocks in minimum block size */
 static mini_block_t *mini_list;
+#endif
 
 /*
  *****************************************************************************
@@ -391,6 +816,45 @@ static bool get_prev_mini(block_t *block) {
 }
 
 
+/**
+ * @brief Returns whether realloc has grown an allocated block since its
+ * header was last written
+ * @param[in] block
+ * @return The grown status of the block
+ */
+static bool get_grown(block_t *block) {
+    return (block->header & grown_mask) != 0;
+}
+
+/**
+ * @brief Marks an allocated block as grown by realloc
+ * @param[out] block
+ */
+static void write_grown(block_t *block) {
+    dbg_requires(get_alloc(block));
+    block->header |= grown_mask;
+}
+
+/**
+ * @brief Returns whether mm_maintain has purged a free block since its
+ * header was last written
+ * @param[in] block
+ * @return The purged status of the block
+ */
+static bool get_purged(block_t *block) {
+    return (block->header & purged_mask) != 0;
+}
+
+/**
+ * @brief Marks a free block as purged, in its header and footer
+ * @param[out] block
+ */
+static void write_purged(block_t *block) {
+    dbg_requires(!get_alloc(block));
+    block->header |= purged_mask;
+    *header_to_footer(block) |= purged_mask;
+}
+
 /**
  * @brief Writes an epilogue header at the given address.
  *
@@ -448,6 +912,21 @@ static void write_pack(block_t *block, size_t size, bool alloc,
     }
 }
 
+/**
+ * @brief Rewrites the previous block statuses of an allocated block, or the
+ * epilogue, keeping its size and its grown mark
+ *
+ * @param[out] block The allocated block
+ * @param[in] prev_alloc The previous block allocation status of the block
+ * @param[in] prev_mini The previous block mini status of the block
+ */
+static void write_prev_status(block_t *block, bool prev_alloc,
+                              bool prev_mini) {
+    dbg_requires(get_alloc(block));
+    block->header = pack_all(get_size(block), true, prev_alloc, prev_mini) |
+                    (block->header & grown_mask);
+}
+
 /**
  * @brief Determines if a block is a mini block
  *
@@ -533,6 +1012,75 @@ static block_t *find_prev(block_t *block) {
     }
 }
 
+#if MM_COMPACT_LINKS
+/**
+ * @brief Converts a free block pointer to a 32-bit link: its offset from
+ * heap_start in units of dsize, plus one so that 0 can stand for NULL.
+ */
+static uint32_t block_to_link(block_t *block) {
+    if (block == NULL) {
+        return 0;
+    }
+    size_t offset = (size_t)((char *)block - (char *)heap_start) / dsize;
+    dbg_assert(offset < UINT32_MAX);
+    return (uint32_t)(offset + 1);
+}
+
+/**
+ * @brief Converts a 32-bit link back to a free block pointer
+ */
+static block_t *link_to_block(uint32_t link) {
+    if (link == 0) {
+        return NULL;
+    }
+    return (block_t *)((char *)heap_start + (size_t)(link - 1) * dsize);
+}
+#endif
+
+/**
+ * @brief Returns the next block in the free list of a free block
+ */
+static block_t *get_next_free(block_t *block) {
+#if MM_COMPACT_LINKS
+    return link_to_block(block->payload.next);
+#else
+    return block->payload.next;
+#endif
+}
+
+/**
+ * @brief Returns the previous block in the free list of a free block
+ */
+static block_t *get_prev_free(block_t *block) {
+#if MM_COMPACT_LINKS
+    return link_to_block(block->payload.prev);
+#else
+    return block->payload.prev;
+#endif
+}
+
+/**
+ * @brief Sets the next block in the free list of a free block
+ */
+static void set_next_free(block_t *block, block_t *next) {
+#if MM_COMPACT_LINKS
+    block->payload.next = block_to_link(next);
+#else
+    block->payload.next = next;
+#endif
+}
+
+/**
+ * @brief Sets the previous block in the free list of a free block
+ */
+static void set_prev_free(block_t *block, block_t *prev) {
+#if MM_COMPACT_LINKS
+    block->payload.prev = block_to_link(prev);
+#else
+    block->payload.prev = prev;
+#endif
+}
+
 /*
  * ---------------------------------------------------------------------------
  *                        END SHORT HELPER FUNCTIONS
@@ -542,9 +1090,92 @@ static block_t *find_prev(block_t *block) {
 /******** The remaining content below are helper and debug routines
  * ********/
 
+/**
+ * @brief Returns the allocator state at the bottom of the heap
+ * @pre The heap has been initialized by mm_init
+ */
+static heap_state_t *get_heap_state(void) {
+    return (heap_state_t *)mem_heap_lo();
+}
+
+/**
+ * @brief Finds where the roots of a heap kept in a file are saved
+ *
+ * @return The saved roots, or NULL if the heap is not kept in a file
+ */
+static heap_roots_t *get_heap_roots(void) {
+    size_t len;
+    heap_roots_t *roots = mem_file_area(&len);
+    return (len >= sizeof(heap_roots_t)) ? roots : NULL;
+}
+
+/**
+ * @brief Fingerprint of the heap layout of this build: the size classes,
+ * the link format, the sizes of every structure kept in the heap, and the
+ * parameters that size the small-object region, the size index, the front
+ * cache, the free buffer, and the headroom table
+ *
+ * @return The fingerprint, which mm_attach compares with the saved one
+ */
+static uint64_t heap_layout(void) {
+    const uint64_t params[] = {MM_COMPACT_LINKS,
+                               MM_BACKGROUND,
+                               MM_EXACT_MAX,
+                               MM_SMALL_MAX,
+                               MM_SMALL_PAGESIZE,
+                               MM_SMALL_PAGES,
+                               MM_SIZE_INDEX_MIN,
+                               MM_CACHE_MAX,
+                               MM_CACHE_DEPTH,
+                               MM_FREE_BUFFER,
+                               MM_HEADROOM_SLOTS,
+                               sizeof(heap_state_t),
+                               sizeof(small_region_t),
+                               sizeof(size_index_t),
+                               sizeof(front_cache_t),
+                               sizeof(free_buffer_t),
+                               sizeof(headroom_t),
+                               sizeof(sampler_t),
+                               sizeof(struct mm_arena),
+                               sizeof(struct mm_pool)};
+
+    uint64_t layout = 0;
+    for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+        layout = layout * 31 + params[i];
+    }
+    for (size_t i = 0; i < LENGTH - EXACT_BINS - 1; i++) {
+        layout = layout * 31 + class_bounds[i];
+    }
+    return layout;
+}
+
+/**
+ * @brief Takes the heap lock if the maintenance thread is running. Every
+ * public entry point holds it; it is recursive, since they call each other.
+ */
+static void heap_lock(void) {
+#if MM_BACKGROUND
+    if (heap_start != NULL && get_heap_state()->bg != NULL) {
+        pthread_mutex_lock(&get_heap_state()->bg->lock);
+    }
+#endif
+}
+
+/**
+ * @brief Releases the heap lock taken by heap_lock
+ */
+static void heap_unlock(void) {
+#if MM_BACKGROUND
+    if (heap_start != NULL && get_heap_state()->bg != NULL) {
+        pthread_mutex_unlock(&get_heap_state()->bg->lock);
+    }
+#endif
+}
+
 /**
  * @brief Finds the specific free-list class in seg_list for the new block
- * given its size
+ * given its size: its exact-size class up to MM_EXACT_MAX, and otherwise
+ * the first larger class whose bound is above it
  *
  * @pre The size is greater or equal to the miminum block size
  * @param[in] asize the size of the given block
@@ -554,35 +1185,98 @@ static block_t *find_prev(block_t *block) {
 static size_t find_class(size_t asize) {
     dbg_requires(asize >= min_block_size);
 
-    if (asize < 32) {
-        return (size_t) 0;
-    } else if (asize < 64) {
-        return (size_t) 1;
-    } else if (asize < 128) {
-        return (size_t) 2;
-    } else if (asize < 256) {
-        return (size_t) 3;
-    } else if (asize < 512) {
-        return (size_t) 4;
-    } else if (asize < 1024) {
-        return (size_t) 5;
-    } else if (asize < 2048) {
-        return (size_t) 6;
-    } else if (asize < 3072) {
-        return (size_t) 7;
-    } else if (asize < 4096) {
-        return (size_t) 8;
-    } else if (asize < 6656) {
-        return (size_t) 9;
-    } else if (asize < 8192) {
-        return (size_t) 10;
-    } else if (asize < 16384) {
-        return (size_t) 11;
-    } else if (asize < 32768) {
-        return (size_t) 12;
-    } else {
-        return (size_t) 13;
+    if (asize <= MM_EXACT_MAX) {
+        return asize / dsize - 1;
+    }
+
+    size_t class = 0;
+    while (class < LENGTH - EXACT_BINS - 1 && asize >= class_bounds[class]) {
+        class++;
+    }
+    return EXACT_BINS + class;
+}
+
+/**
+ * @brief Returns the smallest block size of a class
+ */
+
+static size_t class_floor(size_t class) {
+    if (class < EXACT_BINS) {
+        return (class + 1) * dsize;
+    }
+
+    size_t floor = MM_EXACT_MAX + dsize;
+    if (class > EXACT_BINS) {
+        floor = max(floor, class_bounds[class - EXACT_BINS - 1]);
+    }
+    return floor;
+}
+
+/**
+ * @brief Returns the exclusive upper bound of the block sizes of a class,
+ * SIZE_MAX for the last one
+ */
+
+static size_t class_limit(size_t class) {
+    if (class < EXACT_BINS) {
+        return (class + 2) * dsize;
+    }
+    if (class == LENGTH - 1) {
+        return SIZE_MAX;
+    }
+    return class_bounds[class - EXACT_BINS];
+}
+
+/**
+ * @brief Marks a class as non-empty in the bitmap of classes
+ */
+
+static void map_set(size_t class) {
+    list_map[class / 64] |= (uint64_t)1 << (class % 64);
+}
+
+/**
+ * @brief Marks a class as empty in the bitmap of classes
+ */
+
+static void map_clear(size_t class) {
+    list_map[class / 64] &= ~((uint64_t)1 << (class % 64));
+}
+
+/**
+ * @brief Recomputes the bitmap of classes from seg_list, after the lists
+ * were emptied or taken over from a saved heap
+ */
+
+static void map_rebuild(void) {
+    for (size_t w = 0; w < MAP_WORDS; w++) {
+        list_map[w] = 0;
+    }
+    for (size_t i = 0; i < LENGTH; i++) {
+        if (seg_list[i] != NULL) {
+            map_set(i);
+        }
+    }
+}
+
+/**
+ * @brief Finds the first non-empty class from the given one upwards
+ *
+ * @param[in] class The class to start at, at most LENGTH
+ * @return The class, or LENGTH if all of them are empty
+ */
+
+static size_t next_class(size_t class) {
+    for (size_t w = class / 64; w < MAP_WORDS; w++) {
+        uint64_t bits = list_map[w];
+        if (w == class / 64) {
+            bits &= ~(uint64_t)0 << (class % 64);
+        }
+        if (bits != 0) {
+            return w * 64 + (size_t)__builtin_ctzll(bits);
+        }
     }
+    return LENGTH;
 }
 
 /**
@@ -609,8 +1303,259 @@ static int is_head(block_t *block) {
 }
 
 /**
- * @brief Inserts the given new block pointer into the head of its corresponding
- * free list in seg_list
+ * @brief Looks for the list successor of a block by walking the heap: in an
+ * address-ordered list, it is the next free block of the same class.
+ *
+ * @param[in] block The block about to be inserted
+ * @param[in] class The class of the block
+ * @return The successor, or NULL if it is not among the next
+ * MM_ORDER_LOOKAHEAD blocks
+ */
+
+static block_t *find_heap_successor(block_t *block, size_t class) {
+    for (int i = 0; i < MM_ORDER_LOOKAHEAD; i++) {
+        block = find_next(block);
+        size_t size = get_size(block);
+
+        /* Reached the epilogue or the wilderness, which is in no list */
+        if (size == 0 || block == get_heap_state()->wilderness) {
+            return NULL;
+        }
+
+        if (!get_alloc(block) && find_class(size) == class) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Inserts the given block into the free list of the given class,
+ * keeping the list sorted by address.
+ *
+ * The successor is usually among the next few blocks in the heap. Failing
+ * that, the list walk starts at the finger, the block inserted last, when
+ * that is in the same class, and goes up or down from there.
+ *
+ * @param[out] block The location to insert the new free block
+ * @param[in] class The class of the block
+ */
+
+static void insert_ordered(block_t *block, size_t class) {
+    heap_state_t *state = get_heap_state();
+    block_t *finger = state->finger;
+    block_t *prev = NULL;
+    block_t *curr = seg_list[class];
+    block_t *succ = find_heap_successor(block, class);
+
+    if (succ != NULL) {
+        curr = succ;
+        prev = (curr == seg_list[class]) ? NULL : get_prev_free(curr);
+    } else if (finger != NULL && find_class(get_size(finger)) == class) {
+        if (finger < block) {
+            prev = finger;
+            curr = get_next_free(finger);
+        } else {
+            /* Walk back; the head's prev pointer is not maintained */
+            curr = finger;
+            prev = (curr == seg_list[class]) ? NULL : get_prev_free(curr);
+            while (prev != NULL && prev > block) {
+                curr = prev;
+                prev = (curr == seg_list[class]) ? NULL : get_prev_free(curr);
+            }
+        }
+    }
+
+    while (curr != NULL && curr < block) {
+        prev = curr;
+        curr = get_next_free(curr);
+    }
+
+    set_prev_free(block, prev);
+    set_next_free(block, curr);
+
+    if (prev != NULL) {
+        set_next_free(prev, block);
+    } else {
+        seg_list[class] = block;
+    }
+
+    if (curr != NULL) {
+        set_prev_free(curr, block);
+    }
+
+    state->finger = block;
+}
+
+/**
+ * @brief Returns the payload word of a free block that holds its entry in
+ * the size index
+ */
+static word_t *index_slot(block_t *block) {
+    return (word_t *)block->payload.data + 2;
+}
+
+/**
+ * @brief Adds a free block that was just linked into its class to the size
+ * index, if the index is enabled and covers the class
+ *
+ * @param[in] block The free block
+ * @param[in] class Its class
+ */
+static void index_insert(block_t *block, size_t class) {
+    size_index_t *index = get_heap_state()->index;
+    if (index == NULL || class < index->first) {
+        return;
+    }
+
+    index->length[class]++;
+    uint32_t k = index->count[class];
+    if (index->overflow[class] || k == index->cap[class]) {
+        index->overflow[class] = true;
+        return;
+    }
+
+    index->sizes[class][k] = get_size(block);
+    index->blocks[class][k] = block;
+    *index_slot(block) = k;
+    index->count[class] = k + 1;
+}
+
+/**
+ * @brief Removes a free block that is about to be unlinked from its class
+ * from the size index, moving the last entry of the class into its place
+ *
+ * @param[in] block The free block
+ * @param[in] class Its class
+ */
+static void index_remove(block_t *block, size_t class) {
+    size_index_t *index = get_heap_state()->index;
+    if (index == NULL || class < index->first) {
+        return;
+    }
+
+    /* An overflowed class is covered again once its list empties */
+    if (index->overflow[class]) {
+        if (--index->length[class] == 0) {
+            index->overflow[class] = false;
+            index->count[class] = 0;
+        }
+        return;
+    }
+
+    size_t *sizes = index->sizes[class];
+    block_t **blocks = index->blocks[class];
+    size_t k = (size_t)*index_slot(block);
+    uint32_t last = index->count[class] - 1;
+    dbg_assert(k <= last && blocks[k] == block);
+
+    sizes[k] = sizes[last];
+    blocks[k] = blocks[last];
+    *index_slot(blocks[k]) = k;
+    index->count[class] = last;
+    index->length[class] = last;
+}
+
+/* The allocator's own side structures come from the heap through these,
+ * which neither take the heap lock nor count as calls for the checker */
+static void *malloc_locked(size_t size);
+static void free_locked(void *bp);
+
+/**
+ * @brief Reallocates the entries of a class of the size index that
+ * overflowed, doubling them until its whole list fits, and refills them
+ * from the list. The entries come from the heap, so this runs from
+ * index_prepare before a search, not inside insert_free; the class is walked
+ * instead until then, or for good if the heap has no room.
+ *
+ * @param[in] index The size index
+ * @param[in] class An overflowed class it covers
+ */
+static void index_grow(size_index_t *index, size_t class) {
+    size_t cap = max(2 * (size_t)index->cap[class], MM_SIZE_INDEX_INIT);
+    while (cap < index->length[class]) {
+        cap *= 2;
+    }
+
+    size_t *sizes = malloc_locked(cap * (sizeof(size_t) + sizeof(block_t *)));
+    if (sizes == NULL) {
+        return;
+    }
+    free_locked(index->sizes[class]);
+
+    /* The allocation and free may have changed the list; refill from it */
+    index->sizes[class] = sizes;
+    index->blocks[class] = (block_t **)(sizes + cap);
+    index->cap[class] = (uint32_t)cap;
+    index->length[class] = 0;
+    index->count[class] = 0;
+    index->overflow[class] = false;
+
+    for (block_t *block = seg_list[class]; block != NULL;
+         block = get_next_free(block)) {
+        index_insert(block, class);
+    }
+}
+
+/**
+ * @brief Gives entries to the overflowed classes that earlier best-fit
+ * searches walked, once their lists are long enough to be worth scanning
+ * through the index. This runs before a search rather than during it, as the
+ * allocations it makes change the lists; they skip it in turn.
+ */
+static void index_prepare(void) {
+    size_index_t *index = get_heap_state()->index;
+    if (index == NULL || !index->pending || index->growing) {
+        return;
+    }
+
+    index->growing = true;
+    index->pending = false;
+    for (size_t i = index->first; i < LENGTH; i++) {
+        if (index->wanted[i]) {
+            index->wanted[i] = false;
+            if (index->overflow[i]) {
+                index_grow(index, i);
+            }
+        }
+    }
+    index->growing = false;
+}
+
+/**
+ * @brief Best fit within one class covered by the size index: the smallest
+ * block of at least asize bytes. The loop reads nothing but the dense size
+ * array, in a form the compiler can vectorize; there are no intrinsics, as
+ * mdriver-emulate could not run them.
+ *
+ * @param[in] index The size index
+ * @param[in] class A class it covers and that has not overflowed
+ * @param[in] asize The needed size
+ * @return The location of the free block found, or NULL if there isn't one
+ */
+static block_t *index_best(size_index_t *index, size_t class, size_t asize) {
+    const size_t *sizes = index->sizes[class];
+    size_t n = index->count[class];
+    size_t best = n;
+    size_t best_size = SIZE_MAX;
+
+    for (size_t k = 0; k < n; k++) {
+        if (sizes[k] >= asize && sizes[k] < best_size) {
+            best_size = sizes[k];
+            best = k;
+        }
+    }
+
+    return (best < n) ? index->blocks[class][best] : NULL;
+}
+
+/**
+ * @brief Inserts the given new block pointer into its corresponding free list
+ * in seg_list: at the head in LIFO order, or by address in address order.
+ * Mini blocks always go to the head of the mini list, or of class 0 with
+ * MM_COMPACT_LINKS. A block next to the
+ * epilogue becomes the wilderness instead, which is kept out of all lists.
  *
  * @param[out] block The location to insert the new free block
  */
@@ -618,6 +1563,13 @@ static int is_head(block_t *block) {
 static void insert_free(block_t *block) {
     dbg_requires(block != NULL);
 
+    /* For the wilderness */
+    if (get_size(find_next(block)) == 0) {
+        get_heap_state()->wilderness = block;
+        return;
+    }
+
+#if !MM_COMPACT_LINKS
     /* For mini-block */
     if (is_mini_block(block)) {
         mini_block_t *curr_mini = (mini_block_t*) block;
@@ -636,23 +1588,33 @@ static void insert_free(block_t *block) {
 
         return;
     }
+#endif
 
     size_t class = find_class(get_size(block));
+    map_set(class);
+
+    if (get_heap_state()->order == MM_LIST_ADDRESS) {
+        insert_ordered(block, class);
+        index_insert(block, class);
+        return;
+    }
+
     block_t *curr = seg_list[class];
     seg_list[class] = block;
 
     /* Given that the current free list is not empty */
     if (curr != NULL) {
-        curr->payload.prev = block;
-        block->payload.next = curr;
+        set_prev_free(curr, block);
+        set_next_free(block, curr);
     }
 
     /* Given that the current free list is empty */
     else {
-        block->payload.next = NULL;
-        block->payload.prev = NULL;
+        set_next_free(block, NULL);
+        set_prev_free(block, NULL);
     }
 
+    index_insert(block, class);
     return;
 }
 
@@ -665,6 +1627,14 @@ static void insert_free(block_t *block) {
 static void remove_free(block_t *block) {
     dbg_requires(block != NULL);
 
+    /* For the wilderness */
+    heap_state_t *state = get_heap_state();
+    if (block == state->wilderness) {
+        state->wilderness = NULL;
+        return;
+    }
+
+#if !MM_COMPACT_LINKS
     /* For mini-block */
     if (is_mini_block(block)) {
         mini_block_t *mini_block = (mini_block_t*) block;
@@ -691,9 +1661,19 @@ static void remove_free(block_t *block) {
 
         return;
     }
+#endif
+
+    if (state->index != NULL) {
+        index_remove(block, find_class(get_size(block)));
+    }
+
+    block_t *prev = get_prev_free(block);
+    block_t *next = get_next_free(block);
 
-    block_t *prev = block->payload.prev;
-    block_t *next = block->payload.next;
+    /* Keep the next-fit rover on a block that is still free */
+    if (state->rover == block) {
+        state->rover = next;
+    }
 
     int head_ind = is_head(block);
     bool head;
@@ -703,25 +1683,33 @@ static void remove_free(block_t *block) {
         head = true;
     }
 
-    bool tail = (block->payload.next == NULL);
+    /* Keep the address-order finger on a block that is still free */
+    if (state->finger == block) {
+        state->finger = head ? NULL : prev;
+    }
+
+    bool tail = (get_next_free(block) == NULL);
 
     /* Case when the block is the head */
     if (head) {
         size_t class = (size_t)head_ind;
-        seg_list[class] = block->payload.next;
+        seg_list[class] = next;
+        if (next == NULL) {
+            map_clear(class);
+        }
         return;
     }
 
     /* Case when the block is the tail */
     if (tail) {
-        prev->payload.next = NULL;
+        set_next_free(prev, NULL);
         return;
     }
 
     /* Case when the block is in the middle of its free list */
     if (!head && !tail) {
-        prev->payload.next = next;
-        next->payload.prev = prev;
+        set_next_free(prev, next);
+        set_prev_free(next, prev);
         return;
     }
 }
@@ -759,7 +1747,7 @@ static block_t *coalesce_block(block_t *block) {
     /* Case one: both prev and next are allocated */
     if (prev_alloc && next_alloc) {
 
-        write_pack(next, next_size, true, false, is_mini_block(block));
+        write_prev_status(next, false, is_mini_block(block));
 
         insert_free(block);
         return block;
@@ -774,7 +1762,7 @@ static block_t *coalesce_block(block_t *block) {
         bool prev_prev_mini = get_prev_mini(prev);
 
         write_pack(prev, total_size, false, prev_prev_alloc, prev_prev_mini);          
-        write_pack(next, next_size, true, false, false);
+        write_prev_status(next, false, false);
 
         insert_free(prev);
         return prev;
@@ -790,10 +1778,7 @@ static block_t *coalesce_block(block_t *block) {
         write_pack(block, total_size, false, true, prev_mini);
 
         block_t *next_next = find_next(next);
-        size_t next_next_size = get_size(next_next);
-        bool next_next_alloc = get_alloc(next_next);
-
-        write_pack(next_next, next_next_size, next_next_alloc, false, false);
+        write_prev_status(next_next, false, false);
 
         insert_free(block);
         return block;
@@ -811,10 +1796,7 @@ static block_t *coalesce_block(block_t *block) {
         write_pack(prev, total_size, false, prev_prev_alloc, prev_prev_mini); 
 
         block_t *next_next = find_next(next);
-        size_t next_next_size = get_size(next_next);
-        bool next_next_alloc = get_alloc(next_next);
-
-        write_pack(next_next, next_next_size, next_next_alloc, false, false);
+        write_prev_status(next_next, false, false);
 
         insert_free(prev);
         return prev;
@@ -835,6 +1817,12 @@ static block_t *extend_heap(size_t size) {
 
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
+#if MM_COMPACT_LINKS
+    // Links must stay addressable in 32 bits of dsize units
+    if (mem_heapsize() + size > ((size_t)UINT32_MAX - 1) * dsize) {
+        return NULL;
+    }
+#endif
     if ((bp = mem_sbrk((intptr_t)size)) == (void *)-1) {
         return NULL;
     }
@@ -852,6 +1840,14 @@ static block_t *extend_heap(size_t size) {
     // Coalesce in case the previous block was free
     block = coalesce_block(block);
 
+#if MM_BACKGROUND
+    // Growth is pressure: let the maintenance thread run a slice early
+    background_t *bg = get_heap_state()->bg;
+    if (bg != NULL) {
+        pthread_cond_signal(&bg->wake);
+    }
+#endif
+
     return block;
 }
 
@@ -898,539 +1894,3468 @@ static block_t *split_block(block_t *block, size_t asize) {
 
 
 /**
- * @brief Finds the corresponding class of the given data in the segregated 
- * list. Then, searches the current and following classes with a better-fit 
- * approach to find a free block that is large enough to store the data of asize
- * while maximizing the memory utilization
+ * @brief Allocates a block of asize bytes from the back of the given free
+ * block, and returns the front to the free lists.
  *
+ * Large requests are placed this way so that they cluster at the high end
+ * of free space while small requests cluster at the low end, instead of
+ * long-lived large buffers being pinned between short-lived small objects.
+ *
+ * @pre The block is free, out of the free lists, and at least asize +
+ * min_block_size bytes
+ * @param[in] block The free block to split
  * @param[in] asize The needed size
- * @return The location of the free block founded, or NULL if there isn't one
+ * @return The location of the allocated block
  */
+static block_t *split_block_back(block_t *block, size_t asize) {
+    dbg_requires(!get_alloc(block));
+    dbg_requires(get_size(block) >= asize + min_block_size);
 
-static block_t *find_fit(size_t asize) {
-    dbg_requires(asize > 0);
+    size_t block_size = get_size(block);
+    size_t front_size = block_size - asize;
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_mini = get_prev_mini(block);
 
-    /* For mini-block, use the first free block in mini list if there is one */
-    if(asize == min_block_size && mini_list != NULL) {
-        return (block_t*) mini_list;
-    }
+    write_pack(block, front_size, false, prev_alloc, prev_mini);
 
-    size_t class = find_class(asize);
+    block_t *back = find_next(block);
+    write_pack(back, asize, true, false, front_size == min_block_size);
 
-    for (size_t i = class; i < LENGTH; i++) {
+    /* The next block is allocated, since free neighbours are coalesced */
+    block_t *next = find_next(back);
+    write_prev_status(next, true, asize == min_block_size);
 
-        block_t *best = NULL;
-        block_t *block = seg_list[i];
+    /* The front's neighbours are both allocated, so no coalescing needed */
+    insert_free(block);
 
-        /* Search for each class */
-        while (block != NULL) {
+    return back;
+}
 
-            if (!(get_alloc(block)) && (asize <= get_size(block))) {
+/**
+ * @brief Allocates a block of asize bytes from the front of the wilderness,
+ * bumping the wilderness header forward past it.
+ *
+ * This bypasses the free lists entirely: the remainder stays the wilderness,
+ * and nothing is coalesced, since the allocated block's neighbours are an
+ * allocated block (or the prologue) and the remainder.
+ *
+ * @pre The wilderness exists and is at least asize bytes
+ * @param[in] asize The needed size
+ * @return The location of the allocated block
+ */
+static block_t *alloc_wilderness(size_t asize) {
+    heap_state_t *state = get_heap_state();
+    block_t *block = state->wilderness;
+    dbg_requires(block != NULL && get_size(block) >= asize);
 
-                if (best == NULL) {
-                    best = block;
-                }
-                    
-                else if (get_size(block) < get_size(best)) {
-                    best = block;
-                }
-                    
-                else {
-                    return best;
-                }
-                
-            } 
+    size_t block_size = get_size(block);
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_mini = get_prev_mini(block);
 
-            block = block->payload.next;
-        }
+    /* Take the whole wilderness if the rest would be too small for a block */
+    if (block_size - asize < min_block_size) {
+        asize = block_size;
+    }
 
-        /* Return if one is found after finishing searching for one class */
-        if (best != NULL) {
-            return best;
-        }
+    write_pack(block, asize, true, prev_alloc, prev_mini);
+    block_t *rest = find_next(block);
+
+    if (asize == block_size) {
+        write_epilogue(rest, true, asize == min_block_size);
+        state->wilderness = NULL;
+    } else {
+        write_pack(rest, block_size - asize, false, true,
+                   asize == min_block_size);
+        write_epilogue(find_next(rest), false, is_mini_block(rest));
+        state->wilderness = rest;
     }
 
-    return NULL;
+    return block;
 }
 
-
 /**
- * @brief
- * Checks if prologue and epilogue are allocated and have size zero
+ * @brief Moves a large allocated block into a new block of asize bytes at
+ * the end of the heap, placed so that its payload has the same offset
+ * within a page as the old one. mem_remap can then move the payload's pages
+ * instead of copying them. The old block is left allocated.
+ *
+ * The bytes between the wilderness and the new block, less than a page,
+ * are returned to the free lists.
+ *
+ * @param[in] block The allocated block to move
+ * @param[in] asize The size of the new block, larger than the old one
+ * @return The location of the new block, or NULL if the heap cannot grow
  */
+static block_t *remap_block(block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block) && asize > get_size(block));
 
-static bool check_prologue_epilogue(void) {
-
-    word_t *prologue = (word_t *)mem_heap_lo();
-    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+    heap_state_t *state = get_heap_state();
+    block_t *front = state->wilderness;
+    size_t wild_size = (front != NULL) ? get_size(front) : 0;
 
-    /* Check for allocation status */
-    bool pro_alloc_true = (extract_alloc(*prologue) == true);
-    if (!pro_alloc_true) {
-        dbg_printf("Prologue not allocated.\n");
-        return false;
+    // Without a wilderness the new block starts at the epilogue
+    if (front == NULL) {
+        front = (block_t *)((char *)mem_heap_hi() + 1 - wsize);
     }
 
-    bool epi_alloc_true = (get_alloc(epilogue) == true);
-    if (!epi_alloc_true) {
-        dbg_printf("Epilogue not allocated.\n");
-        return false;
-    }
+    void *old_bp = header_to_payload(block);
+    uintptr_t front_bp = (uintptr_t)front + wsize;
+    size_t gap = ((uintptr_t)old_bp - front_bp) & (mem_pagesize() - 1);
 
-    /* Check for size */
-    size_t pro_size = extract_size(*prologue);
-    if (pro_size != 0) {
-        dbg_printf("Incorrect prologue size.\n");
-        return false;
+    if (wild_size < gap + asize &&
+        extend_heap(max(gap + asize - wild_size, chunksize)) == NULL) {
+        return NULL;
     }
 
-    size_t epi_size = get_size(epilogue);
-    if (epi_size != 0) {
-        dbg_printf("Incorrect epilogue size.\n");
-        return false;
+    block_t *pad = (gap > 0) ? alloc_wilderness(gap) : NULL;
+    block_t *new_block = alloc_wilderness(asize);
+
+    // Free the padding in front of the new block
+    if (pad != NULL) {
+        write_pack(pad, gap, false, get_prev_alloc(pad), get_prev_mini(pad));
+        write_prev_alloc(new_block, false);
+        coalesce_block(pad);
     }
 
-    return true;
+    mem_remap(header_to_payload(new_block), old_bp, get_size(block) - wsize);
+
+    return new_block;
 }
 
 /**
- * @brief
- * Checks if the block payload is aligned with 16 bytes
+ * @brief Grows an allocated block to asize bytes where it is, by taking the
+ * free block after it. The last block of the heap grows the heap first if
+ * the wilderness is too small. Whatever asize leaves over is freed.
+ *
+ * @param[in] block The allocated block to grow
+ * @param[in] asize The size it needs, larger than its size
+ * @return true if the block grew, and false if the block after it is
+ * allocated or too small, or the heap cannot grow
  */
+static bool grow_in_place(block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block) && asize > get_size(block));
 
-static bool check_alignment(block_t *block) {
+    size_t block_size = get_size(block);
+    block_t *next = find_next(block);
 
-    bool is_aligned = (((size_t)header_to_payload(block) % 16) == 0);
+    /* Without a wilderness, the next block is the epilogue */
+    if (get_size(next) == 0 || next == get_heap_state()->wilderness) {
+        size_t have = block_size + get_size(next);
+        if (have < asize) {
+            if (extend_heap(max(asize - have, chunksize)) == NULL) {
+                return false;
+            }
+            next = find_next(block);
+        }
+    }
 
-    if (!is_aligned) {
-        dbg_printf("Misalignment at %p\n", (void *)block);
+    size_t next_size = get_size(next);
+    if (get_alloc(next) || block_size + next_size < asize) {
         return false;
     }
 
-    return true;
-}
-
-/**
- * @brief
- * Checks if the block lies within the boundary
- */
+    remove_free(next);
+    write_pack(block, block_size + next_size, true, get_prev_alloc(block),
+               get_prev_mini(block));
 
-static bool check_boundary(block_t *block) {
-
-    if ((void *)block > mem_heap_hi()) {
-        dbg_printf("Block out of upper bound %p\n", (void *)block);
-        return false;
-    }
+    /* The block after the free one is allocated, or the epilogue */
+    block_t *after = find_next(block);
+    write_prev_status(after, true, false);
 
-    if ((void *)block < mem_heap_lo()) {
-        dbg_printf("Block out of lower bound %p\n", (void *)block);
-        return false;
+    block_t *rest = split_block(block, asize);
+    if (rest != NULL) {
+        coalesce_block(rest);
     }
-
     return true;
 }
 
 /**
- * @brief
- * Checks if there are two consecutive free blocks (coalesce fails)
+ * @brief Grows an allocated block to asize bytes by merging it with the free
+ * block before it, and the one after it if that is free too, and moving its
+ * payload down to the start of the merged block. Whatever asize leaves over
+ * is freed.
+ *
+ * @param[in] block The allocated block to grow
+ * @param[in] asize The size it needs, larger than its size
+ * @return The location of the grown block, or NULL if the free neighbours
+ * are too small
  */
+static block_t *grow_backward(block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block) && asize > get_size(block));
 
-static bool check_non_consecutive_free(block_t *block) {
+    if (get_prev_alloc(block)) {
+        return NULL;
+    }
 
+    block_t *prev = find_prev(block);
     block_t *next = find_next(block);
+    size_t prev_size = get_size(prev);
+    size_t block_size = get_size(block);
+    bool next_free = !get_alloc(next);
+    size_t total = prev_size + block_size + (next_free ? get_size(next) : 0);
+    if (total < asize) {
+        return NULL;
+    }
 
-    bool curr_alloc = get_alloc(block);
-    bool next_alloc = get_alloc(next);
+    remove_free(prev);
+    if (next_free) {
+        remove_free(next);
+    }
 
-    if (!curr_alloc && !next_alloc) {
-        dbg_printf("Two consecutive free blocks.\n");
-        dbg_printf("First block is %p\n", (void *)block);
-        dbg_printf("Second block is %p\n", (void *)next);
-        return false;
+    /* Copy in pieces no longer than the distance moved, so that the source
+     * and destination of each copy do not overlap */
+    char *dst = header_to_payload(prev);
+    char *src = header_to_payload(block);
+    size_t len = block_size - wsize;
+    for (size_t off = 0; off < len; off += prev_size) {
+        memcpy(dst + off, src + off, (len - off < prev_size) ? len - off
+                                                            : prev_size);
     }
 
-    return true;
+    write_pack(prev, total, true, get_prev_alloc(prev), get_prev_mini(prev));
+
+    /* The block after the merged one is allocated, or the epilogue */
+    block_t *after = find_next(prev);
+    write_prev_status(after, true, false);
+
+    block_t *rest = split_block(prev, asize);
+    if (rest != NULL) {
+        coalesce_block(rest);
+    }
+    return prev;
 }
 
 /**
- * @brief
- * Checks if the header and footer of the block match
+ * @brief Frees the tail of an allocated block beyond asize bytes, if it is
+ * big enough to be a block
+ *
+ * @param[in] block The allocated block
+ * @param[in] asize The size it keeps, at most its size
  */
-
+static void shrink_in_place(block_t *block, size_t asize) {
+    block_t *rest = split_block(block, asize);
+    if (rest != NULL) {
+        coalesce_block(rest);
+    }
+}
+
+/**
+ * @brief Returns the size realloc grows a block to when it has grown the
+ * block before: asize and MM_REALLOC_HEADROOM percent more
+ *
+ * @param[in] asize The size the block needs
+ */
+static size_t headroom_size(size_t asize) {
+    return asize + round_up(asize / 100 * MM_REALLOC_HEADROOM, dsize);
+}
+
+/**
+ * @brief Returns the entry of a block in the headroom table, or
+ * MM_HEADROOM_SLOTS if it has none
+ */
+static size_t headroom_find(headroom_t *table, block_t *block) {
+    for (size_t i = 0; i < MM_HEADROOM_SLOTS; i++) {
+        if (table->blocks[i] == block) {
+            return i;
+        }
+    }
+    return MM_HEADROOM_SLOTS;
+}
+
+/**
+ * @brief Drops a block from the headroom table, if it is there, leaving its
+ * headroom in place; for blocks being freed or resized
+ *
+ * @param[in] table The headroom table
+ * @param[in] block The block
+ */
+static void headroom_forget(headroom_t *table, block_t *block) {
+    size_t i = headroom_find(table, block);
+    if (i < MM_HEADROOM_SLOTS) {
+        table->blocks[i] = NULL;
+    }
+}
+
+/**
+ * @brief Gives the headroom of every block in the headroom table back to
+ * the free lists
+ *
+ * @param[in] table The headroom table
+ * @return The number of blocks trimmed
+ */
+static size_t headroom_release(headroom_t *table) {
+    size_t trimmed = 0;
+    for (size_t i = 0; i < MM_HEADROOM_SLOTS; i++) {
+        if (table->blocks[i] != NULL) {
+            shrink_in_place(table->blocks[i], table->need[i]);
+            table->blocks[i] = NULL;
+            trimmed++;
+        }
+    }
+    return trimmed;
+}
+
+/**
+ * @brief First fit: returns the first block that fits, searching the classes
+ * from the one of asize upwards
+ *
+ * @param[in] asize The needed size
+ * @return The location of the free block found, or NULL if there isn't one
+ */
+static block_t *find_fit_first(size_t asize) {
+    for (size_t i = next_class(find_class(asize)); i < LENGTH;
+         i = next_class(i + 1)) {
+        for (block_t *block = seg_list[i]; block != NULL;
+             block = get_next_free(block)) {
+            if (asize <= get_size(block)) {
+                return block;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Next fit: like first fit, but the search in the rover's class
+ * starts at the rover and wraps around to the head of the list. The rover
+ * is left on the successor of the block returned.
+ *
+ * @param[in] asize The needed size
+ * @return The location of the free block found, or NULL if there isn't one
+ */
+static block_t *find_fit_next(size_t asize) {
+    heap_state_t *state = get_heap_state();
+    block_t *rover = state->rover;
+    size_t rover_class = (rover != NULL) ? find_class(get_size(rover)) : LENGTH;
+
+    for (size_t i = next_class(find_class(asize)); i < LENGTH;
+         i = next_class(i + 1)) {
+        block_t *start = (i == rover_class) ? rover : seg_list[i];
+
+        /* From the rover to the tail */
+        for (block_t *block = start; block != NULL;
+             block = get_next_free(block)) {
+            if (asize <= get_size(block)) {
+                state->rover = get_next_free(block);
+                return block;
+            }
+        }
+
+        /* From the head up to the rover */
+        for (block_t *block = seg_list[i]; block != start;
+             block = get_next_free(block)) {
+            if (asize <= get_size(block)) {
+                state->rover = get_next_free(block);
+                return block;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Best fit: returns the smallest block that fits in the first class
+ * that has one, stopping early on an exact fit. Classes covered by the size
+ * index are searched through it instead of their lists.
+ *
+ * @param[in] asize The needed size
+ * @return The location of the free block found, or NULL if there isn't one
+ */
+static block_t *find_fit_best(size_t asize) {
+    size_index_t *index = get_heap_state()->index;
+
+    for (size_t i = next_class(find_class(asize)); i < LENGTH;
+         i = next_class(i + 1)) {
+        if (index != NULL && i >= index->first && !index->overflow[i]) {
+            block_t *best = index_best(index, i, asize);
+            if (best != NULL) {
+                return best;
+            }
+            continue;
+        }
+
+        /* Give a long list entries before the next search */
+        if (index != NULL && i >= index->first &&
+            index->length[i] >= MM_SIZE_INDEX_INIT) {
+            index->wanted[i] = true;
+            index->pending = true;
+        }
+
+        block_t *best = NULL;
+
+        for (block_t *block = seg_list[i]; block != NULL;
+             block = get_next_free(block)) {
+            size_t size = get_size(block);
+            if (asize <= size && (best == NULL || size < get_size(best))) {
+                best = block;
+                if (size == asize) {
+                    return best;
+                }
+            }
+        }
+
+        if (best != NULL) {
+            return best;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Good fit: searches the current and following classes with a
+ * better-fit approach, settling for the best block found so far once
+ * `patience` fitting blocks in a row have failed to improve on it
+ *
+ * @param[in] asize The needed size
+ * @return The location of the free block found, or NULL if there isn't one
+ */
+static block_t *find_fit_good(size_t asize) {
+    unsigned int patience = get_heap_state()->patience;
+
+    for (size_t i = next_class(find_class(asize)); i < LENGTH;
+         i = next_class(i + 1)) {
+
+        block_t *best = NULL;
+        block_t *block = seg_list[i];
+        unsigned int misses = 0;
+
+        /* Search for each class */
+        while (block != NULL) {
+
+            if (!(get_alloc(block)) && (asize <= get_size(block))) {
+
+                if (best == NULL) {
+                    best = block;
+                }
+                    
+                else if (get_size(block) < get_size(best)) {
+                    best = block;
+                }
+                    
+                else if (++misses >= patience) {
+                    return best;
+                }
+                
+            } 
+
+            block = get_next_free(block);
+        }
+
+        /* Return if one is found after finishing searching for one class */
+        if (best != NULL) {
+            return best;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Finds a free block that is large enough to store the data of
+ * asize: the head of the mini list for mini blocks, the head of the first
+ * non-empty exact-size class that fits, since all of its blocks are the
+ * same, and otherwise whatever the current fit policy picks from the
+ * segregated lists
+ *
+ * @param[in] asize The needed size
+ * @return The location of the free block founded, or NULL if there isn't one
+ */
+
+static block_t *find_fit(size_t asize) {
+    dbg_requires(asize > 0);
+
+#if !MM_COMPACT_LINKS
+    /* For mini-block, use the first free block in mini list if there is one */
+    if(asize == min_block_size && mini_list != NULL) {
+        return (block_t*) mini_list;
+    }
+#endif
+
+    size_t class = next_class(find_class(asize));
+    if (class < EXACT_BINS) {
+        return seg_list[class];
+    }
+
+    switch ((mm_fit_policy_t)get_heap_state()->policy) {
+    case MM_FIT_FIRST:
+        return find_fit_first(asize);
+    case MM_FIT_NEXT:
+        return find_fit_next(asize);
+    case MM_FIT_BEST:
+        return find_fit_best(asize);
+    default:
+        return find_fit_good(asize);
+    }
+}
+
+
+/**
+ * @brief Pushes a small-object page onto the head of a page list
+ *
+ * @param[in] list The list head
+ * @param[in] page The page to push
+ */
+static void small_page_push(small_page_t **list, small_page_t *page) {
+    page->prev = NULL;
+    page->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = page;
+    }
+    *list = page;
+}
+
+/**
+ * @brief Unlinks a small-object page from a page list
+ *
+ * @param[in] list The list head
+ * @param[in] page The page to unlink
+ */
+static void small_page_unlink(small_page_t **list, small_page_t *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        *list = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+}
+
+/**
+ * @brief Checks if a small-object page has no free slot left
+ */
+static bool small_page_full(small_page_t *page) {
+    return page->used == page->slots;
+}
+
+/**
+ * @brief Returns the small-object region, creating it on first use
+ *
+ * @return The region, or NULL if the heap has no room for it
+ */
+static small_region_t *small_region(void) {
+    heap_state_t *state = get_heap_state();
+    if (state->small != NULL) {
+        return state->small;
+    }
+
+    /* Leave room for aligning the pages and for the region header */
+    size_t size = sizeof(small_region_t) + (MM_SMALL_PAGES + 1) *
+                                               (size_t)MM_SMALL_PAGESIZE;
+    small_region_t *region = malloc_locked(size);
+    if (region == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < SMALL_CLASSES; i++) {
+        region->partial[i] = NULL;
+    }
+    region->empty = NULL;
+    region->pages = (char *)round_up((uintptr_t)(region + 1),
+                                     MM_SMALL_PAGESIZE);
+    region->next_page = 0;
+
+    state->small = region;
+    return region;
+}
+
+/**
+ * @brief Checks if a payload pointer lies in the small-object region
+ */
+static bool is_small_object(const void *bp) {
+    small_region_t *region = get_heap_state()->small;
+    if (region == NULL) {
+        return false;
+    }
+
+    const char *p = bp;
+    return p >= region->pages &&
+           p < region->pages + MM_SMALL_PAGES * (size_t)MM_SMALL_PAGESIZE;
+}
+
+/**
+ * @brief Returns the metadata of the small-object page holding a slot
+ */
+static small_page_t *small_page_of(const void *bp) {
+    small_region_t *region = get_heap_state()->small;
+    size_t index = (size_t)((const char *)bp - region->pages) /
+                   MM_SMALL_PAGESIZE;
+    return &region->meta[index];
+}
+
+/**
+ * @brief Returns the bits of one word of a small-object page's bitmap that
+ * lie past the page's last slot
+ *
+ * @param[in] page The page
+ * @param[in] w The index of the word
+ */
+static uint64_t small_map_padding(small_page_t *page, size_t w) {
+    size_t first = w * 64;
+    if (first >= page->slots) {
+        return ~(uint64_t)0;
+    }
+    if (page->slots - first >= 64) {
+        return 0;
+    }
+    return ~(uint64_t)0 << (page->slots - first);
+}
+
+/**
+ * @brief Returns the first slot of a small-object page
+ */
+static char *small_page_base(small_region_t *region, small_page_t *page) {
+    return region->pages +
+           (size_t)(page - region->meta) * MM_SMALL_PAGESIZE;
+}
+
+/**
+ * @brief Allocates a header-free slot of at least size bytes from the
+ * small-object region
+ *
+ * @pre 0 < size <= MM_SMALL_MAX
+ * @param[in] size The requested size
+ * @return The slot, or NULL if the region cannot be created or has no
+ * page left for the size
+ */
+static void *small_alloc(size_t size) {
+    dbg_requires(size > 0 && size <= MM_SMALL_MAX);
+
+    small_region_t *region = small_region();
+    if (region == NULL) {
+        return NULL;
+    }
+
+    size_t class = round_up(size, dsize) / dsize - 1;
+    small_page_t *page = region->partial[class];
+
+    /* Take an empty page, or else one never used, for this size */
+    if (page == NULL) {
+        if (region->empty != NULL) {
+            page = region->empty;
+            small_page_unlink(&region->empty, page);
+        } else if (region->next_page < MM_SMALL_PAGES) {
+            page = &region->meta[region->next_page];
+            region->next_page++;
+        } else {
+            return NULL;
+        }
+
+        page->slot_size = (uint16_t)((class + 1) * dsize);
+        page->slots = (uint16_t)(MM_SMALL_PAGESIZE / page->slot_size);
+        page->used = 0;
+        page->class = (uint16_t)class;
+
+        /* Bits past the last slot stay set, so they are never taken */
+        for (size_t w = 0; w < SMALL_MAP_WORDS; w++) {
+            page->map[w] = small_map_padding(page, w);
+        }
+        small_page_push(&region->partial[class], page);
+    }
+
+    /* The lowest free slot, from the first bitmap word with a clear bit */
+    size_t w = 0;
+    while (page->map[w] == ~(uint64_t)0) {
+        w++;
+    }
+    size_t bit = (size_t)__builtin_ctzll(~page->map[w]);
+    page->map[w] |= (uint64_t)1 << bit;
+    page->used++;
+    void *slot = small_page_base(region, page) + (w * 64 + bit) *
+                                                     page->slot_size;
+
+    if (small_page_full(page)) {
+        small_page_unlink(&region->partial[class], page);
+    }
+
+    return slot;
+}
+
+/**
+ * @brief Returns a slot to its small-object page. A page that was full
+ * goes back on its partial list, and a page left with no slot allocated
+ * goes on the empty list, to be reused for any size.
+ *
+ * @param[in] bp The slot to free
+ */
+static void small_free(void *bp) {
+    small_region_t *region = get_heap_state()->small;
+    small_page_t *page = small_page_of(bp);
+    size_t slot = (size_t)((char *)bp - small_page_base(region, page)) /
+                  page->slot_size;
+    dbg_requires(page->map[slot / 64] & ((uint64_t)1 << (slot % 64)));
+    bool was_full = small_page_full(page);
+
+    page->map[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+    page->used--;
+
+    if (page->used == 0) {
+        if (!was_full) {
+            small_page_unlink(&region->partial[page->class], page);
+        }
+        small_page_push(&region->empty, page);
+    } else if (was_full) {
+        small_page_push(&region->partial[page->class], page);
+    }
+}
+
+/**
+ * @brief Takes a cached block of exactly asize bytes from the front cache
+ *
+ * @param[in] cache The front cache
+ * @param[in] asize The needed size, at most MM_CACHE_MAX
+ * @return The location of the block, or NULL if its bin is empty
+ */
+static block_t *cache_pop(front_cache_t *cache, size_t asize) {
+    size_t bin = asize / dsize - 1;
+    block_t *block = cache->bins[bin];
+    if (block != NULL) {
+        cache->bins[bin] = *(block_t **)header_to_payload(block);
+        cache->count[bin]--;
+    }
+    return block;
+}
+
+/**
+ * @brief Keeps an allocated block in the front cache instead of freeing it,
+ * if its bin has room
+ *
+ * @param[in] cache The front cache
+ * @param[in] block The block being freed, still marked allocated
+ * @param[in] size The size of the block
+ * @return true if the block was cached, and false if it must be freed
+ */
+static bool cache_push(front_cache_t *cache, block_t *block, size_t size) {
+    dbg_requires(size == get_size(block));
+    if (size > MM_CACHE_MAX) {
+        return false;
+    }
+
+    size_t bin = size / dsize - 1;
+    if (cache->count[bin] == MM_CACHE_DEPTH) {
+        return false;
+    }
+
+    /* The block keeps its header while cached, so drop the grown mark that
+     * free would clear; whoever takes it next has not grown it */
+    block->header &= ~grown_mask;
+    *(block_t **)header_to_payload(block) = cache->bins[bin];
+    cache->bins[bin] = block;
+    cache->count[bin]++;
+    return true;
+}
+
+/**
+ * @brief Frees up to budget blocks of the front cache, so that they
+ * coalesce with their neighbours
+ *
+ * @param[in] cache The front cache
+ * @param[in] budget The most blocks to free
+ * @return The number of blocks freed
+ */
+static size_t cache_flush(front_cache_t *cache, size_t budget) {
+    heap_state_t *state = get_heap_state();
+    size_t flushed = 0;
+
+    /* Keep free from caching the blocks again */
+    state->cache = NULL;
+    for (size_t i = 0; i < CACHE_BINS && flushed < budget; i++) {
+        while (cache->bins[i] != NULL && flushed < budget) {
+            void *bp = header_to_payload(cache->bins[i]);
+            cache->bins[i] = *(block_t **)bp;
+            cache->count[i]--;
+            free_locked(bp);
+            flushed++;
+        }
+    }
+    state->cache = cache;
+
+    return flushed;
+}
+
+/**
+ * @brief Carries out the frees in the free buffer. The blocks are sorted by
+ * address, so that a single forward pass finds the runs of adjacent ones;
+ * each run is then written as one free block and coalesced once, instead
+ * of every block in it rewriting its neighbours' headers and footers.
+ *
+ * @param[in] buffer The free buffer
+ * @return The number of blocks freed
+ */
+static size_t buffer_flush(free_buffer_t *buffer) {
+    block_t **blocks = buffer->blocks;
+    size_t count = buffer->count;
+
+    /* Insertion sort: the buffer is short, and teardown tends to free in
+     * address order already, or in reverse order, which is turned around
+     * first */
+    if (count > 1 && blocks[0] > blocks[count - 1]) {
+        for (size_t i = 0, j = count - 1; i < j; i++, j--) {
+            block_t *block = blocks[i];
+            blocks[i] = blocks[j];
+            blocks[j] = block;
+        }
+    }
+    for (size_t i = 1; i < count; i++) {
+        block_t *block = blocks[i];
+        size_t j = i;
+        while (j > 0 && blocks[j - 1] > block) {
+            blocks[j] = blocks[j - 1];
+            j--;
+        }
+        blocks[j] = block;
+    }
+
+    for (size_t i = 0; i < count;) {
+        block_t *run = blocks[i];
+        size_t run_size = get_size(run);
+
+        for (i++; i < count && blocks[i] == (block_t *)((char *)run + run_size);
+             i++) {
+            run_size += get_size(blocks[i]);
+        }
+
+        write_pack(run, run_size, false, get_prev_alloc(run),
+                   get_prev_mini(run));
+        coalesce_block(run);
+    }
+
+    buffer->count = 0;
+    return count;
+}
+
+/**
+ * @brief Adds an allocated block to the free buffer instead of freeing it,
+ * flushing the buffer once it is full
+ *
+ * @param[in] buffer The free buffer
+ * @param[in] block The block being freed, still marked allocated
+ */
+static void buffer_push(free_buffer_t *buffer, block_t *block) {
+    buffer->blocks[buffer->count++] = block;
+    if (buffer->count == MM_FREE_BUFFER) {
+        buffer_flush(buffer);
+    }
+}
+
+/**
+ * @brief find_fit, retried after the blocks held back by the front cache
+ * and the free buffer are returned to the free lists, if nothing fits
+ * before, rather than grow the heap around them
+ *
+ * @param[in] asize The needed size
+ * @return The location of the free block found, or NULL if there isn't one
+ */
+static block_t *find_fit_flushed(size_t asize) {
+    block_t *block = find_fit(asize);
+    if (block != NULL) {
+        return block;
+    }
+
+    heap_state_t *state = get_heap_state();
+    size_t flushed = 0;
+
+    /* The cache frees into the buffer, so it goes first */
+    if (state->cache != NULL) {
+        flushed += cache_flush(state->cache, SIZE_MAX);
+    }
+    if (state->buffer != NULL) {
+        flushed += buffer_flush(state->buffer);
+    }
+
+    return (flushed > 0) ? find_fit(asize) : NULL;
+}
+
+/**
+ * @brief Gives the pages of a large free block back to the system, keeping
+ * its header, links, size index entry, and footer, plus the first keep
+ * bytes of the block. A block purged since it was freed is skipped.
+ *
+ * @param[in] block A free block
+ * @param[in] keep Bytes at the front of the block to leave resident
+ * @return The number of resident bytes given back
+ */
+static size_t purge_block(block_t *block, size_t keep) {
+    if (get_size(block) < MM_PURGE_MIN || get_purged(block)) {
+        return 0;
+    }
+
+    char *lo = (char *)block + max(keep, 4 * wsize);
+    char *hi = (char *)header_to_footer(block);
+    if (hi <= lo) {
+        return 0;
+    }
+
+    size_t purged = mem_purge(lo, (size_t)(hi - lo));
+    write_purged(block);
+    return purged;
+}
+
+/**
+ * @brief
+ * Checks if prologue and epilogue are allocated and have size zero
+ */
+
+static bool check_prologue_epilogue(void) {
+
+    word_t *prologue = (word_t *)heap_start - 1;
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+
+    /* Check for allocation status */
+    bool pro_alloc_true = (extract_alloc(*prologue) == true);
+    if (!pro_alloc_true) {
+        dbg_printf("Prologue not allocated.\n");
+        return false;
+    }
+
+    bool epi_alloc_true = (get_alloc(epilogue) == true);
+    if (!epi_alloc_true) {
+        dbg_printf("Epilogue not allocated.\n");
+        return false;
+    }
+
+    /* Check for size */
+    size_t pro_size = extract_size(*prologue);
+    if (pro_size != 0) {
+        dbg_printf("Incorrect prologue size.\n");
+        return false;
+    }
+
+    size_t epi_size = get_size(epilogue);
+    if (epi_size != 0) {
+        dbg_printf("Incorrect epilogue size.\n");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks that the bitmap of every page handed out by the small-object region
+ * counts its allocated slots and keeps the bits past its last slot set
+ */
+
+static bool check_small_region(void) {
+
+    small_region_t *region = get_heap_state()->small;
+    if (region == NULL) {
+        return true;
+    }
+
+    for (size_t i = 0; i < region->next_page; i++) {
+        small_page_t *page = &region->meta[i];
+        if (page->slots != MM_SMALL_PAGESIZE / page->slot_size) {
+            dbg_printf("Small page %zu has %u slots of %u bytes.\n", i,
+                       page->slots, page->slot_size);
+            return false;
+        }
+
+        size_t set = 0;
+        for (size_t w = 0; w < SMALL_MAP_WORDS; w++) {
+            uint64_t padding = small_map_padding(page, w);
+            if ((page->map[w] & padding) != padding) {
+                dbg_printf("Small page %zu lost a bit past its last slot.\n",
+                           i);
+                return false;
+            }
+            set += (size_t)__builtin_popcountll(page->map[w] & ~padding);
+        }
+
+        if (set != page->used) {
+            dbg_printf("Small page %zu has %zu slots allocated, %u used.\n",
+                       i, set, page->used);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks that every block in the front cache is allocated, of its bin's
+ * size, and counted
+ */
+
+static bool check_front_cache(void) {
+
+    front_cache_t *cache = get_heap_state()->cache;
+    if (cache == NULL) {
+        return true;
+    }
+
+    for (size_t i = 0; i < CACHE_BINS; i++) {
+        size_t count = 0;
+
+        for (block_t *block = cache->bins[i]; block != NULL;
+             block = *(block_t **)header_to_payload(block)) {
+            if (!get_alloc(block) || get_size(block) != (i + 1) * dsize) {
+                dbg_printf("Cached block %p is free or in the wrong bin.\n",
+                           (void *)block);
+                return false;
+            }
+            count++;
+        }
+
+        if (count != cache->count[i] || count > MM_CACHE_DEPTH) {
+            dbg_printf("Cache bin %zu has %zu blocks, counted %u.\n", i,
+                       count, cache->count[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks that every block in the free buffer is allocated, and that the
+ * buffer was flushed when it filled up
+ */
+
+static bool check_free_buffer(void) {
+
+    free_buffer_t *buffer = get_heap_state()->buffer;
+    if (buffer == NULL) {
+        return true;
+    }
+
+    if (buffer->count >= MM_FREE_BUFFER) {
+        dbg_printf("Free buffer holds %zu blocks.\n", buffer->count);
+        return false;
+    }
+
+    for (size_t i = 0; i < buffer->count; i++) {
+        if (!get_alloc(buffer->blocks[i])) {
+            dbg_printf("Buffered block %p is free.\n",
+                       (void *)buffer->blocks[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks that every block in the headroom table is allocated, large enough
+ * for its data, and listed once
+ */
+
+static bool check_headroom(void) {
+
+    headroom_t *table = get_heap_state()->headroom;
+    if (table == NULL) {
+        return true;
+    }
+
+    for (size_t i = 0; i < MM_HEADROOM_SLOTS; i++) {
+        block_t *block = table->blocks[i];
+        if (block == NULL) {
+            continue;
+        }
+
+        if (!get_alloc(block) || get_size(block) < table->need[i] ||
+            headroom_find(table, block) != i) {
+            dbg_printf("Bad headroom entry %p: %zu bytes, %zu needed.\n",
+                       (void *)block, get_size(block), table->need[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks that the size index holds exactly the blocks of every class it
+ * covers, with their current sizes
+ */
+
+static bool check_size_index(void) {
+
+    size_index_t *index = get_heap_state()->index;
+    if (index == NULL) {
+        return true;
+    }
+
+    for (size_t i = index->first; i < LENGTH; i++) {
+        size_t length = 0;
+
+        for (block_t *block = seg_list[i]; block != NULL;
+             block = get_next_free(block)) {
+            size_t k = (size_t)*index_slot(block);
+            if (!index->overflow[i] &&
+                (k >= index->count[i] || index->blocks[i][k] != block ||
+                 index->sizes[i][k] != get_size(block))) {
+                dbg_printf("Block %p has no size index entry.\n",
+                           (void *)block);
+                return false;
+            }
+            length++;
+        }
+
+        if (length != index->length[i] ||
+            (!index->overflow[i] && length != index->count[i])) {
+            dbg_printf("Class %zu has %zu blocks, counted %u, %u entries.\n",
+                       i, length, index->length[i], index->count[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks that the wilderness is exactly the free block next to the epilogue,
+ * if there is one
+ */
+
+static bool check_wilderness(void) {
+
+    block_t *wilderness = get_heap_state()->wilderness;
+    block_t *last = NULL;
+
+    for (block_t *curr = heap_start; get_size(curr) > 0;
+         curr = find_next(curr)) {
+        last = curr;
+    }
+
+    if (last != NULL && !get_alloc(last)) {
+        if (wilderness != last) {
+            dbg_printf("Last block %p is free but not the wilderness.\n",
+                       (void *)last);
+            return false;
+        }
+    } else if (wilderness != NULL) {
+        dbg_printf("Wilderness %p is not a free last block.\n",
+                   (void *)wilderness);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks if the block payload is aligned with 16 bytes
+ */
+
+static bool check_alignment(block_t *block) {
+
+    bool is_aligned = (((size_t)header_to_payload(block) % 16) == 0);
+
+    if (!is_aligned) {
+        dbg_printf("Misalignment at %p\n", (void *)block);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks if the block lies within the boundary
+ */
+
+static bool check_boundary(block_t *block) {
+
+    if ((void *)block > mem_heap_hi()) {
+        dbg_printf("Block out of upper bound %p\n", (void *)block);
+        return false;
+    }
+
+    if ((void *)block < mem_heap_lo()) {
+        dbg_printf("Block out of lower bound %p\n", (void *)block);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks if there are two consecutive free blocks (coalesce fails)
+ */
+
+static bool check_non_consecutive_free(block_t *block) {
+
+    block_t *next = find_next(block);
+
+    bool curr_alloc = get_alloc(block);
+    bool next_alloc = get_alloc(next);
+
+    if (!curr_alloc && !next_alloc) {
+        dbg_printf("Two consecutive free blocks.\n");
+        dbg_printf("First block is %p\n", (void *)block);
+        dbg_printf("Second block is %p\n", (void *)next);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks if the header and footer of the block match
+ */
+
 static bool check_header_footer_match(block_t *block) {
 
-    bool curr_alloc = get_alloc(block);
-    word_t header = block->header;
-    word_t footer = *(header_to_footer(block));
+    bool curr_alloc = get_alloc(block);
+    word_t header = block->header;
+    word_t footer = *(header_to_footer(block));
+    block_t *next = find_next(block);
+    bool is_mini = get_prev_mini(next);
+
+    if (!curr_alloc && !is_mini && (header != footer)) {
+        dbg_printf("Header and footer do not match.\n");
+        dbg_printf("The block is %p\n", (void *)block);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks if the block size is valid
+ */
+
+static bool check_block_size(block_t *block) {
+
+    size_t size = get_size(block);
+
+    if ((size < min_block_size) || (size % 16 != 0)) {
+        dbg_printf("Invalid block size at %p\n", (void *)block);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks if the heap is valid
+ */
+
+static bool general_heap_checker(void) {
+    dbg_requires(heap_start != NULL);
+
+    if (!check_prologue_epilogue()) {
+        return false;
+    }
+
+    block_t *curr = heap_start;
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+
+    while (curr != epilogue) {
+
+        if (!check_alignment(curr)) {
+            return false;
+        }
+
+        if (!check_boundary(curr)) {
+            return false;
+        }
+
+        if (!check_block_size(curr)) {
+            return false;
+        }
+
+        if (!check_header_footer_match(curr)) {
+            return false;
+        }
+
+        if (!check_non_consecutive_free(curr)) {
+            return false;
+        }
+
+        curr = find_next(curr);
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ * Checks if the segregated list is valid
+ */
+
+static bool check_list(void) {
+
+    for (size_t i = 0; i < LENGTH; i++) {
+        block_t *curr = seg_list[i];
+
+        /* Checks that the bitmap knows which lists are empty */
+        bool mapped = (list_map[i / 64] >> (i % 64)) & 1;
+        if (mapped != (curr != NULL)) {
+            dbg_printf("Class %zu is %s but marked %s in the bitmap.\n", i,
+                       (curr != NULL) ? "non-empty" : "empty",
+                       mapped ? "non-empty" : "empty");
+            return false;
+        }
+
+        while (curr != NULL) {
+
+            /* Checks if the free list pointer is between mem_heap_lo() and
+            mem_heap_high() */
+            if ((void *)curr > mem_heap_hi()) {
+                dbg_printf("Block out of upper bound %p\n", (void *)curr);
+                return false;
+            }
+
+            if ((void *)curr < mem_heap_lo()) {
+                dbg_printf("Block out of lower bound %p\n", (void *)curr);
+                return false;
+            }
+
+            /* Checks if the next/previous pointers are consistent */
+            block_t *next = get_next_free(curr);
+            if (next != NULL) {
+                bool is_prev = (get_prev_free(next) == curr);
+                if (!is_prev) {
+                    dbg_printf("Next/previous pointers are not consistent.\n");
+                    dbg_printf("The block is %p\n", (void *)curr);
+                    dbg_printf("The next block is %p\n", (void *)next);
+                    return false;
+                }
+            }
+
+            /* Checks that the wilderness is kept out of the lists */
+            if (curr == get_heap_state()->wilderness) {
+                dbg_printf("The wilderness %p is in a free list.\n",
+                           (void *)curr);
+                return false;
+            }
+
+            /* Checks if the block falls within the desired bucket size range */
+            size_t class = find_class(get_size(curr));
+            if (class != i) {
+                dbg_printf("The block is not in the desired list bucket.\n");
+                dbg_printf("The block is %p\n", (void *)curr);
+                return false;
+            }
+
+            curr = get_next_free(curr);
+        }
+    }
+
+    /* Checks that the lists are sorted in address order */
+    if (get_heap_state()->order == MM_LIST_ADDRESS) {
+        for (size_t i = 0; i < LENGTH; i++) {
+            for (block_t *curr = seg_list[i]; curr != NULL;
+                 curr = get_next_free(curr)) {
+                block_t *next = get_next_free(curr);
+                if (next != NULL && next < curr) {
+                    dbg_printf("Free list %zu out of address order at %p.\n",
+                               i, (void *)curr);
+                    return false;
+                }
+            }
+        }
+    }
+
+    /* Checks that the finger points to a free block */
+    block_t *finger = get_heap_state()->finger;
+    if (finger != NULL && get_alloc(finger)) {
+        dbg_printf("Address-order finger %p is allocated.\n", (void *)finger);
+        return false;
+    }
+
+    /* Checks that the next-fit rover points to a free block */
+    block_t *rover = get_heap_state()->rover;
+    if (rover != NULL && get_alloc(rover)) {
+        dbg_printf("Next-fit rover %p is allocated.\n", (void *)rover);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Overall heap cheacker than tracks heap performance and checks for
+ * invariants
+ *
+ * @return true if the heap check passes, and false otherwise
+ */
+static bool checkheap_locked(void) {
+
+    if (!general_heap_checker()) {
+        return false;
+    }
+
+    if (!check_list()) {
+        return false;
+    }
+
+    if (!check_wilderness()) {
+        return false;
+    }
+
+    if (!check_small_region()) {
+        return false;
+    }
+
+    if (!check_size_index()) {
+        return false;
+    }
+
+    if (!check_front_cache()) {
+        return false;
+    }
+
+    if (!check_free_buffer()) {
+        return false;
+    }
+
+    if (!check_headroom()) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Runs every heap check while holding the heap lock, so that a
+ * background maintenance slice cannot change the heap under the checker
+ *
+ * @param[in] line The line where the assertion failure raises, given the
+ * function returns false
+ * @return true if the heap check passes, and false otherwise
+ */
+bool mm_checkheap(int line) {
+    heap_lock();
+    bool ok = checkheap_locked();
+    heap_unlock();
+    return ok;
+}
+
+
+
+/**
+ * @brief Checks one block for the sampled checker: the same invariants as
+ * general_heap_checker, tested in an order that never reads outside the
+ * heap, however corrupt the header
+ *
+ * @param[in] block The block to check
+ * @param[in] epilogue The epilogue header
+ * @return true if the block passes, and false otherwise
+ */
+static bool sample_block(block_t *block, block_t *epilogue) {
+    if (block < heap_start || block >= epilogue || !check_alignment(block)) {
+        return false;
+    }
+
+    size_t size = get_size(block);
+    if (!check_block_size(block) ||
+        size > (size_t)((char *)epilogue - (char *)block)) {
+        return false;
+    }
+
+    return check_header_footer_match(block) &&
+           check_non_consecutive_free(block);
+}
+
+/**
+ * @brief Checks one free list node for the sampled checker: that it is a
+ * free block of its list's class whose successor links back to it
+ *
+ * @param[in] block The node to check
+ * @param[in] class The list it was reached through
+ * @param[in] epilogue The epilogue header
+ * @return true if the node passes, and false otherwise
+ */
+static bool sample_node(block_t *block, size_t class, block_t *epilogue) {
+    if (!sample_block(block, epilogue) || get_alloc(block) ||
+        find_class(get_size(block)) != class) {
+        return false;
+    }
+
+    block_t *next = get_next_free(block);
+    return next == NULL ||
+           (next >= heap_start && next < epilogue && check_alignment(next) &&
+            get_prev_free(next) == block);
+}
+
+/**
+ * @brief Stops the heap from touching anything that may be corrupt: the
+ * free lists and every side structure are dropped, frees become leaks, and
+ * allocations come from memory the heap has yet to grow into
+ */
+static void quarantine_heap(void) {
+    heap_state_t *state = get_heap_state();
+
+    for (size_t i = 0; i < LENGTH; i++) {
+        seg_list[i] = NULL;
+    }
+    map_rebuild();
+#if !MM_COMPACT_LINKS
+    mini_list = NULL;
+#endif
+    state->rover = NULL;
+    state->finger = NULL;
+    state->index = NULL;
+    state->cache = NULL;
+    state->buffer = NULL;
+    state->headroom = NULL;
+    state->small_objects = false;
+
+    /* The last block counts as allocated, so growth never coalesces */
+    state->wilderness = NULL;
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+    write_epilogue(epilogue, true, false);
+}
+
+/**
+ * @brief One run of the sampled checker: walks up to a slice of blocks from
+ * a random free block (or the start of the heap) and a few nodes of a
+ * random free list, then resizes the slice to keep to the budget
+ *
+ * @param[in] sampler The sampled checker
+ */
+static void sample_heap(sampler_t *sampler) {
+    struct timespec start, end;
+    timespec_get(&start, TIME_UTC);
+
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+    size_t budget = sampler->slice;
+    bool ok = true;
+
+    /* A random class, and the head of its list as the place to start */
+    sampler->rng ^= sampler->rng << 13;
+    sampler->rng ^= sampler->rng >> 7;
+    sampler->rng ^= sampler->rng << 17;
+    size_t class = (size_t)(sampler->rng % LENGTH);
+
+    block_t *block = seg_list[class];
+    for (size_t n = 0; ok && block != NULL && n < budget / 4; n++) {
+        ok = sample_node(block, class, epilogue);
+        block = ok ? get_next_free(block) : block;
+        sampler->stats.inspected++;
+    }
+
+    if (ok) {
+        block = (seg_list[class] != NULL) ? seg_list[class] : heap_start;
+    }
+    for (size_t n = 0; ok && block != epilogue && n < budget; n++) {
+        ok = sample_block(block, epilogue);
+        block = ok ? find_next(block) : block;
+        sampler->stats.inspected++;
+    }
+
+    sampler->stats.checks++;
+    if (!ok) {
+        sampler->stats.corrupt_op = sampler->stats.ops;
+        fprintf(stderr,
+                "mm: heap corruption at %p found by the sampled check after "
+                "operation %" PRIu64 "\n",
+                (void *)block,
+                sampler->stats.ops);
+        if (sampler->action == MM_CHECK_ABORT) {
+            abort();
+        }
+        quarantine_heap();
+        sampler->quarantined = true;
+        return;
+    }
+
+    /* Halve the slice when a run costs more than the interval allows, and
+     * double it when it costs less than half */
+    timespec_get(&end, TIME_UTC);
+    uint64_t ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+                  (uint64_t)(end.tv_nsec - start.tv_nsec);
+    uint64_t allowed = (uint64_t)sampler->budget_ns * sampler->interval;
+    if (ns > allowed && sampler->slice > 8) {
+        sampler->slice /= 2;
+    } else if (2 * ns < allowed && sampler->slice < (1 << 16)) {
+        sampler->slice *= 2;
+    }
+}
+
+/**
+ * @brief Counts one operation for the sampled checker, running it every
+ * interval operations
+ */
+static void sample_tick(void) {
+    if (heap_start == NULL) {
+        return;
+    }
+
+    sampler_t *sampler = get_heap_state()->sampler;
+    if (sampler == NULL || sampler->quarantined) {
+        return;
+    }
+
+    sampler->stats.ops++;
+    if (--sampler->countdown == 0) {
+        sampler->countdown = sampler->interval;
+        sample_heap(sampler);
+    }
+}
+
+/**
+ * @brief Initializes the heap, segregated free list, and mini list
+ * @return true if the initialization succeeds, and false otherwise
+ */
+
+bool mm_init(void) {
+
+    // Create the initial empty heap, led by the allocator state
+    heap_state_t *state =
+        mem_sbrk((intptr_t)(sizeof(heap_state_t) + 2 * wsize));
+
+    if (state == (void *)-1) {
+        return false;
+    }
+
+    state->rover = NULL;
+    state->finger = NULL;
+    state->policy = MM_FIT_POLICY;
+    state->order = MM_LIST_ORDER;
+    state->patience = fit_patience;
+    state->wilderness = NULL;
+    state->small = NULL;
+    state->index = NULL;
+    state->cache = NULL;
+    state->buffer = NULL;
+    state->sampler = NULL;
+    state->headroom = NULL;
+#if MM_BACKGROUND
+    state->bg = NULL;
+#endif
+    state->maint = (mm_maint_stats_t){0};
+    state->purge_class = 0;
+    state->small_objects = MM_SMALL_OBJECTS;
+
+    word_t *start = (word_t *)(state + 1);
+
+    /* Roots saved for an older heap in the same file are stale now */
+    heap_roots_t *roots = get_heap_roots();
+    if (roots != NULL) {
+        roots->magic = 0;
+        roots->root = NULL;
+    }
+
+    /* Initialize segregated free list */
+    seg_list = state->lists;
+    for (size_t i = 0; i < LENGTH; i++) {
+        seg_list[i] = NULL;
+    }
+    map_rebuild();
+
+#if !MM_COMPACT_LINKS
+    /* Initialize the mini-block list */
+    mini_list = NULL;
+#endif
+
+    start[0] = pack_all(0, true, false, false); // Heap prologue (block footer)
+    start[1] = pack_all(0, true, true, false); // Heap epilogue (block header)
+
+    // Heap starts with first "block header", currently the epilogue
+    heap_start = (block_t *)&(start[1]);
+
+    // Extend the empty heap with a free block of chunksize bytes
+    if (extend_heap(chunksize) == NULL) {
+        return false;
+    }
+
+    if (MM_FRONT_CACHE && !mm_set_front_cache(true)) {
+        return false;
+    }
+
+    if (MM_DEFER_FREES && !mm_set_deferred_free(true)) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Saves the free list roots in the header page of the heap file, so
+ * that a later process can take the heap over with mm_attach. The heap
+ * must not be used again until then.
+ *
+ * @return true on success, and false if there is no heap or it is not kept
+ * in a file
+ */
+bool mm_detach(void) {
+    heap_roots_t *roots = get_heap_roots();
+    if (heap_start == NULL || roots == NULL) {
+        return false;
+    }
+
+    mm_background_stop();
+
+    roots->layout = heap_layout();
+#if !MM_COMPACT_LINKS
+    roots->mini_list = mini_list;
+#endif
+    roots->magic = heap_magic;
+
+    heap_start = NULL;
+    return true;
+}
+
+/**
+ * @brief Takes over a heap that an earlier process left in a heap file with
+ * mm_detach, restoring the free list roots saved there
+ *
+ * The roots must have been saved by a build with the same heap layout, and
+ * the heap must pass every heap check, which walks it once. The saved
+ * roots are marked stale until the next mm_detach, so that a process that
+ * dies holding the heap does not leave it looking reusable.
+ *
+ * @return true if the heap was taken over, and false otherwise
+ */
+bool mm_attach(void) {
+    heap_state_t *state = get_heap_state();
+    heap_roots_t *roots = get_heap_roots();
+    if (roots == NULL || roots->magic != heap_magic ||
+        roots->layout != heap_layout() ||
+        mem_heapsize() < sizeof(heap_state_t) + 2 * wsize) {
+        return false;
+    }
+
+    word_t *start = (word_t *)(state + 1);
+    heap_start = (block_t *)&(start[1]);
+    seg_list = state->lists;
+    map_rebuild();
+#if !MM_COMPACT_LINKS
+    mini_list = roots->mini_list;
+#endif
+#if MM_BACKGROUND
+    // The thread did not survive the process that started it
+    state->bg = NULL;
+#endif
+
+    if (!checkheap_locked()) {
+        heap_start = NULL;
+        return false;
+    }
+
+    roots->magic = 0;
+    return true;
+}
+
+/**
+ * @brief Writes the heap bytes [lo, hi) to a snapshot as one extent. The
+ * bytes go through a buffer on the stack, so that only the allocator
+ * itself reads the heap.
+ *
+ * @param[in] file The snapshot
+ * @param[in] lo The first byte
+ * @param[in] hi The end of the extent
+ * @return true on success, and false if writing fails
+ */
+static bool snapshot_extent(FILE *file, char *lo, char *hi) {
+    uint64_t extent[2] = {(uint64_t)(lo - (char *)mem_heap_lo()),
+                          (uint64_t)(hi - lo)};
+    if (fwrite(extent, sizeof(extent), 1, file) != 1) {
+        return false;
+    }
+
+    char buf[4096];
+    while (lo < hi) {
+        size_t len = ((size_t)(hi - lo) < sizeof(buf)) ? (size_t)(hi - lo)
+                                                       : sizeof(buf);
+        memcpy(buf, lo, len);
+        if (fwrite(buf, 1, len, file) != len) {
+            return false;
+        }
+        lo += len;
+    }
+    return true;
+}
+
+/**
+ * @brief Writes the heap and the free list roots to a file, from which
+ * mm_restore rebuilds the heap at the same address. Free blocks contribute
+ * only their header, links, size index slot, and footer.
+ *
+ * @param[in] path The file to write
+ * @return true on success, and false if there is no heap or writing fails
+ */
+bool mm_snapshot(const char *path) {
+    if (heap_start == NULL) {
+        return false;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    heap_lock();
+    snapshot_header_t header = {
+        .magic = snapshot_magic,
+        .layout = heap_layout(),
+        .base = (uint64_t)(uintptr_t)mem_heap_lo(),
+        .size = mem_heapsize(),
+    };
+#if !MM_COMPACT_LINKS
+    header.mini_list = mini_list;
+#endif
+    bool ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+
+    /* Cut the free blocks worth skipping out of one extent of the rest */
+    char *lo = mem_heap_lo();
+    block_t *block;
+    for (block = heap_start; ok && get_size(block) > 0;
+         block = find_next(block)) {
+        if (!get_alloc(block) && get_size(block) >= 8 * wsize) {
+            ok = snapshot_extent(file, lo, (char *)block + 4 * wsize);
+            lo = (char *)header_to_footer(block);
+        }
+    }
+    if (ok) {
+        ok = snapshot_extent(file, lo, (char *)mem_heap_hi() + 1);
+    }
+    heap_unlock();
+
+    return (fclose(file) == 0) && ok;
+}
+
+/**
+ * @brief Replaces the heap with one saved by mm_snapshot. The heap must come
+ * back at the address it was saved from, which holds for the dense heap of
+ * a build with the same layout; the bytes of free blocks the snapshot
+ * skipped read as zero.
+ *
+ * @param[in] path The snapshot
+ * @return true on success, and false if the snapshot does not fit this
+ * build or heap, or reading fails; the heap is left empty then
+ */
+bool mm_restore(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    snapshot_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != snapshot_magic || header.layout != heap_layout()) {
+        fclose(file);
+        return false;
+    }
+
+    /* The old heap and anything running on it go away */
+    mm_background_stop();
+    heap_start = NULL;
+    mem_reset_brk();
+    if ((uint64_t)(uintptr_t)mem_heap_lo() != header.base ||
+        header.size < sizeof(heap_state_t) + 2 * wsize ||
+        mem_sbrk((intptr_t)header.size) == (void *)-1) {
+        fclose(file);
+        mem_reset_brk();
+        return false;
+    }
+
+    char *base = mem_heap_lo();
+    uint64_t extent[2];
+    bool ok = true;
+    while (ok && fread(extent, sizeof(extent), 1, file) == 1) {
+        if (extent[0] > header.size || extent[1] > header.size - extent[0]) {
+            ok = false;
+            break;
+        }
+
+        char buf[4096];
+        char *to = base + extent[0];
+        size_t left = extent[1];
+        while (ok && left > 0) {
+            size_t len = (left < sizeof(buf)) ? left : sizeof(buf);
+            ok = (fread(buf, 1, len, file) == len);
+            memcpy(to, buf, len);
+            to += len;
+            left -= len;
+        }
+    }
+    ok = ok && !ferror(file);
+    fclose(file);
+    if (!ok) {
+        mem_reset_brk();
+        return false;
+    }
+
+    heap_state_t *state = get_heap_state();
+    word_t *start = (word_t *)(state + 1);
+    heap_start = (block_t *)&(start[1]);
+    seg_list = state->lists;
+    map_rebuild();
+#if !MM_COMPACT_LINKS
+    mini_list = header.mini_list;
+#endif
+#if MM_BACKGROUND
+    state->bg = NULL;
+#endif
+
+    if (!checkheap_locked()) {
+        heap_start = NULL;
+        mem_reset_brk();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Records the payload from which the application reaches the rest
+ * of its data, next to the saved roots of a heap file
+ *
+ * @param[in] ptr A payload in the heap, or NULL
+ * @return true on success, and false if the heap is not kept in a file
+ */
+bool mm_set_root(void *ptr) {
+    heap_roots_t *roots = get_heap_roots();
+    if (roots == NULL) {
+        return false;
+    }
+
+    roots->root = ptr;
+    return true;
+}
+
+/**
+ * @brief Returns the payload last passed to mm_set_root
+ *
+ * @return The root, or NULL if there is none or the heap is not kept in a
+ * file
+ */
+void *mm_get_root(void) {
+    heap_roots_t *roots = get_heap_roots();
+    return (roots != NULL) ? roots->root : NULL;
+}
+
+
+/**
+ * @brief Selects the fit policy find_fit uses until the next mm_init.
+ * Requests that an exact-size class answers never reach it.
+ *
+ * @param[in] policy The policy to use
+ * @param[in] k Non-improving candidates tolerated by MM_FIT_GOOD; must be
+ * positive for that policy
+ * @return true on success, and false if the heap is not initialized or the
+ * arguments are invalid
+ */
+
+bool mm_set_fit_policy(mm_fit_policy_t policy, unsigned int k) {
+    if (heap_start == NULL) {
+        return false;
+    }
+
+    switch (policy) {
+    case MM_FIT_FIRST:
+    case MM_FIT_NEXT:
+    case MM_FIT_BEST:
+        break;
+    case MM_FIT_GOOD:
+        if (k == 0) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    heap_state_t *state = get_heap_state();
+    state->rover = NULL;
+    state->policy = (uint16_t)policy;
+    if (policy == MM_FIT_GOOD) {
+        state->patience = (uint32_t)k;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Selects how blocks are inserted into the segregated free lists
+ *
+ * Switching to address order rebuilds the lists from a walk of the heap,
+ * so the order can be changed at any time.
+ *
+ * @param[in] order The order to keep the lists in
+ * @return true on success, and false if the heap is not initialized or the
+ * order is invalid
+ */
+
+bool mm_set_list_order(mm_list_order_t order) {
+    if (heap_start == NULL) {
+        return false;
+    }
+
+    if (order != MM_LIST_LIFO && order != MM_LIST_ADDRESS) {
+        return false;
+    }
+
+    heap_state_t *state = get_heap_state();
+    state->order = (uint16_t)order;
+    state->finger = NULL;
+
+    if (order == MM_LIST_ADDRESS) {
+        /* Rebuild the lists by appending free blocks in heap order */
+        block_t *tails[LENGTH];
+        for (size_t i = 0; i < LENGTH; i++) {
+            seg_list[i] = NULL;
+            tails[i] = NULL;
+        }
+
+        for (block_t *block = heap_start; get_size(block) > 0;
+             block = find_next(block)) {
+            if (get_alloc(block) || block == state->wilderness ||
+                (!MM_COMPACT_LINKS && is_mini_block(block))) {
+                continue;
+            }
+
+            size_t class = find_class(get_size(block));
+            set_prev_free(block, tails[class]);
+            set_next_free(block, NULL);
+            if (tails[class] != NULL) {
+                set_next_free(tails[class], block);
+            } else {
+                seg_list[class] = block;
+            }
+            tails[class] = block;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Enables or disables the small-object region for later requests.
+ * Objects already in the region are still freed correctly after disabling.
+ *
+ * @param[in] enable Whether requests of up to MM_SMALL_MAX bytes should be
+ * served from the region
+ * @return true on success, and false if the heap is not initialized
+ */
+
+bool mm_set_small_objects(bool enable) {
+    if (heap_start == NULL) {
+        return false;
+    }
+
+    get_heap_state()->small_objects = enable;
+    return true;
+}
+
+/**
+ * @brief Enables or disables the size index that best fit searches the
+ * larger classes through. Enabling allocates the index from the heap and
+ * fills it from the current free lists.
+ *
+ * @param[in] enable Whether to keep the index
+ * @return true on success, and false if the heap is not initialized or has
+ * no room for the index
+ */
+
+bool mm_set_size_index(bool enable) {
+    if (heap_start == NULL) {
+        return false;
+    }
+
+    heap_state_t *state = get_heap_state();
+    size_index_t *index = state->index;
+    if (!enable) {
+        if (index != NULL) {
+            state->index = NULL;
+            for (size_t i = index->first; i < LENGTH; i++) {
+                free_locked(index->sizes[i]);
+            }
+            free_locked(index);
+        }
+        return true;
+    }
+
+    if (index != NULL) {
+        return true;
+    }
+
+    index = malloc_locked(sizeof(size_index_t));
+    if (index == NULL) {
+        return false;
+    }
+
+    /* Covered blocks need a payload word for their entry after the links,
+     * ahead of the footer, so they take at least 3 * dsize bytes */
+    size_t min_size = max(MM_SIZE_INDEX_MIN, 3 * dsize);
+    index->first = EXACT_BINS;
+    while (index->first < LENGTH && class_floor(index->first) < min_size) {
+        index->first++;
+    }
+
+    /* Count the blocks of every class; index_prepare gives them entries */
+    index->pending = false;
+    index->growing = false;
+    for (size_t i = 0; i < LENGTH; i++) {
+        index->wanted[i] = false;
+        index->sizes[i] = NULL;
+        index->blocks[i] = NULL;
+        index->length[i] = 0;
+        index->count[i] = 0;
+        index->cap[i] = 0;
+        index->overflow[i] = false;
+    }
+
+    state->index = index;
+    for (size_t i = index->first; i < LENGTH; i++) {
+        for (block_t *block = seg_list[i]; block != NULL;
+             block = get_next_free(block)) {
+            index_insert(block, i);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Enables or disables the front cache of recently freed small
+ * blocks. Disabling frees the cached blocks.
+ *
+ * @param[in] enable Whether to keep the cache
+ * @return true on success, and false if the heap is not initialized or has
+ * no room for the cache
+ */
+
+bool mm_set_front_cache(bool enable) {
+    if (heap_start == NULL) {
+        return false;
+    }
+
+    heap_state_t *state = get_heap_state();
+    front_cache_t *cache = state->cache;
+    if (!enable) {
+        if (cache != NULL) {
+            cache_flush(cache, SIZE_MAX);
+            state->cache = NULL;
+            free_locked(cache);
+        }
+        return true;
+    }
+
+    if (cache != NULL) {
+        return true;
+    }
+
+    cache = malloc_locked(sizeof(front_cache_t));
+    if (cache == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < CACHE_BINS; i++) {
+        cache->bins[i] = NULL;
+        cache->count[i] = 0;
+    }
+
+    state->cache = cache;
+    return true;
+}
+
+/**
+ * @brief Enables or disables the free buffer, which defers frees and
+ * carries them out in address-sorted batches. Disabling carries out the
+ * buffered frees.
+ *
+ * @param[in] enable Whether to keep the buffer
+ * @return true on success, and false if the heap is not initialized or has
+ * no room for the buffer
+ */
+
+bool mm_set_deferred_free(bool enable) {
+    if (heap_start == NULL) {
+        return false;
+    }
+
+    heap_state_t *state = get_heap_state();
+    free_buffer_t *buffer = state->buffer;
+    if (!enable) {
+        if (buffer != NULL) {
+            buffer_flush(buffer);
+            state->buffer = NULL;
+            free_locked(buffer);
+        }
+        return true;
+    }
+
+    if (buffer != NULL) {
+        return true;
+    }
+
+    buffer = malloc_locked(sizeof(free_buffer_t));
+    if (buffer == NULL) {
+        return false;
+    }
+
+    buffer->count = 0;
+    state->buffer = buffer;
+    return true;
+}
+
+/**
+ * @brief Enables, reconfigures, or disables the sampled heap checker
+ *
+ * @param[in] interval Operations between runs, or 0 to disable
+ * @param[in] budget_ns Average cost per operation the runs may add
+ * @param[in] action What to do on corruption
+ * @return true on success, and false if the heap is not initialized, the
+ * budget is 0, or there is no room for the checker
+ */
+
+bool mm_set_sampled_check(unsigned int interval, unsigned int budget_ns,
+                          mm_check_action_t action) {
+    if (heap_start == NULL) {
+        return false;
+    }
+
+    heap_state_t *state = get_heap_state();
+    sampler_t *sampler = state->sampler;
+    if (interval == 0) {
+        if (sampler != NULL) {
+            state->sampler = NULL;
+            free_locked(sampler);
+        }
+        return true;
+    }
+
+    if (budget_ns == 0) {
+        return false;
+    }
+
+    if (sampler == NULL) {
+        sampler = malloc_locked(sizeof(sampler_t));
+        if (sampler == NULL) {
+            return false;
+        }
+        sampler->rng = (uint64_t)(uintptr_t)sampler | 1;
+        sampler->slice = 64;
+        sampler->quarantined = false;
+        sampler->stats = (mm_check_stats_t){0};
+        state->sampler = sampler;
+    }
+
+    sampler->interval = interval;
+    sampler->countdown = interval;
+    sampler->budget_ns = budget_ns;
+    sampler->action = (uint8_t)action;
+    return true;
+}
+
+/**
+ * @brief Copies out the counters of the sampled checker, all zero if it is
+ * not enabled
+ *
+ * @param[out] stats Where to store the counters
+ */
+
+void mm_get_check_stats(mm_check_stats_t *stats) {
+    sampler_t *sampler =
+        (heap_start != NULL) ? get_heap_state()->sampler : NULL;
+    *stats = (sampler != NULL) ? sampler->stats : (mm_check_stats_t){0};
+}
+
+/**
+ * @brief Runs one slice of heap maintenance: returns the blocks in the
+ * front cache and the free buffer to the free lists, trims realloc
+ * headroom, then gives the pages of large free blocks
+ * back to the system one class at a time, resuming at the class where the
+ * last slice stopped, and ends each sweep with the top of the wilderness
+ * beyond chunksize bytes
+ *
+ * @param[in] budget The most blocks to free or purge
+ * @return The number of blocks freed or purged
+ */
+
+size_t mm_maintain(size_t budget) {
+    if (heap_start == NULL) {
+        return 0;
+    }
+
+    heap_lock();
+    heap_state_t *state = get_heap_state();
+    mm_maint_stats_t *stats = &state->maint;
+    size_t work = 0;
+    stats->slices++;
+
+    /* Deferred frees first, so that they coalesce before the purge */
+    if (state->cache != NULL) {
+        size_t flushed = cache_flush(state->cache, budget);
+        stats->flushed_blocks += flushed;
+        work += flushed;
+    }
+    if (state->buffer != NULL && work < budget) {
+        size_t flushed = buffer_flush(state->buffer);
+        stats->flushed_blocks += flushed;
+        work += flushed;
+    }
+    if (state->headroom != NULL && work < budget) {
+        work += headroom_release(state->headroom);
+    }
+
+    while (work < budget) {
+        size_t class = state->purge_class;
+
+        if (class == LENGTH) {
+            if (state->wilderness != NULL) {
+                stats->trimmed_bytes +=
+                    purge_block(state->wilderness, chunksize);
+            }
+            state->purge_class = 0;
+            work++;
+            break;
+        }
+
+        /* A slice that runs out of budget moves on anyway, so that every
+         * class gets its turn */
+        state->purge_class = (uint16_t)(class + 1);
+        if (class_limit(class) <= MM_PURGE_MIN) {
+            continue;
+        }
+
+        /* Only blocks that are purged now count: the ones skipped as too
+         * small or purged already must not use up the budget every slice
+         * ahead of the blocks behind them */
+        for (block_t *block = seg_list[class]; block != NULL && work < budget;
+             block = get_next_free(block)) {
+            size_t purged = purge_block(block, 0);
+            if (purged > 0) {
+                stats->purged_bytes += purged;
+                work++;
+            }
+        }
+    }
+
+    heap_unlock();
+    return work;
+}
+
+/**
+ * @brief Copies out the counters of the work done by mm_maintain since
+ * mm_init, all zero if the heap is not initialized
+ *
+ * @param[out] stats Where to store the counters
+ */
+
+void mm_get_maint_stats(mm_maint_stats_t *stats) {
+    if (heap_start == NULL) {
+        *stats = (mm_maint_stats_t){0};
+        return;
+    }
+
+    heap_lock();
+    *stats = get_heap_state()->maint;
+    heap_unlock();
+}
+
+#if MM_BACKGROUND
+/**
+ * @brief Body of the maintenance thread: a slice every period, or sooner
+ * when signalled, with the heap lock released in between
+ *
+ * @param[in] arg The thread's background_t
+ * @return NULL
+ */
+static void *background_main(void *arg) {
+    background_t *bg = arg;
+
+    pthread_mutex_lock(&bg->lock);
+    while (!bg->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += bg->period_ms / 1000;
+        deadline.tv_nsec += (long)(bg->period_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&bg->wake, &bg->lock, &deadline);
+        if (!bg->stop) {
+            mm_maintain(bg->budget);
+        }
+    }
+    pthread_mutex_unlock(&bg->lock);
+
+    return NULL;
+}
+#endif
+
+/**
+ * @brief Starts the maintenance thread, which runs mm_maintain(budget)
+ * every period_ms milliseconds and whenever the heap grows
+ *
+ * @param[in] period_ms Time between slices when nothing signals the thread
+ * @param[in] budget Budget of each slice; must be positive
+ * @return true on success, and false if the heap is not initialized, the
+ * thread is already running, or the build lacks MM_BACKGROUND
+ */
+
+bool mm_background_start(unsigned int period_ms, size_t budget) {
+#if MM_BACKGROUND
+    if (heap_start == NULL || budget == 0) {
+        return false;
+    }
+
+    heap_state_t *state = get_heap_state();
+    if (state->bg != NULL) {
+        return false;
+    }
+
+    background_t *bg = malloc_locked(sizeof(background_t));
+    if (bg == NULL) {
+        return false;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&bg->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_cond_init(&bg->wake, NULL);
+    bg->period_ms = (period_ms > 0) ? period_ms : 1;
+    bg->budget = budget;
+    bg->stop = false;
+
+    /* From here on every entry point takes the lock */
+    state->bg = bg;
+    if (pthread_create(&bg->thread, NULL, background_main, bg) != 0) {
+        state->bg = NULL;
+        pthread_cond_destroy(&bg->wake);
+        pthread_mutex_destroy(&bg->lock);
+        free_locked(bg);
+        return false;
+    }
+
+    return true;
+#else
+    (void)period_ms;
+    (void)budget;
+    return false;
+#endif
+}
+
+/**
+ * @brief Stops the maintenance thread, if it is running, and waits for it
+ * to finish its slice
+ */
+
+void mm_background_stop(void) {
+#if MM_BACKGROUND
+    if (heap_start == NULL) {
+        return;
+    }
+
+    heap_state_t *state = get_heap_state();
+    background_t *bg = state->bg;
+    if (bg == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&bg->lock);
+    bg->stop = true;
+    pthread_cond_signal(&bg->wake);
+    pthread_mutex_unlock(&bg->lock);
+    pthread_join(bg->thread, NULL);
+
+    state->bg = NULL;
+    pthread_cond_destroy(&bg->wake);
+    pthread_mutex_destroy(&bg->lock);
+    free_locked(bg);
+#endif
+}
+
+/**
+ * @brief Asks the maintenance thread, if it is running, for a slice now
+ */
+
+void mm_background_wake(void) {
+#if MM_BACKGROUND
+    if (heap_start != NULL && get_heap_state()->bg != NULL) {
+        pthread_cond_signal(&get_heap_state()->bg->wake);
+    }
+#endif
+}
+
+/**
+ * @brief The fundamental dynamic memory allocator that allocates size bytes
+ * of date on the heap
+ *
+ * @param[in] size The number of bytes to store on the heap
+ * @return The location of the payload of the allocated block, otherwise NULL
+ * if the allocation fails
+ */
+
+static void *malloc_locked(size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t asize;      // Adjusted block size
+    size_t extendsize; // Amount to extend heap if no fit is found
+    block_t *block;
+    void *bp = NULL;
+
+    // Initialize heap if it isn't initialized
+    if (heap_start == NULL) {
+        if (!(mm_init())) {
+            dbg_printf("Problem initializing heap. Likely due to sbrk");
+            return NULL;
+        }
+    }
+
+    // Ignore spurious request
+    if (size == 0) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // Serve small requests from the small-object region if it is enabled
+    // and has room
+    if (size <= MM_SMALL_MAX && get_heap_state()->small_objects) {
+        bp = small_alloc(size);
+        if (bp != NULL) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            return bp;
+        }
+    }
+
+    // Adjust block size to include overhead and to meet alignment requirements
+    asize = round_up(size + wsize, dsize);
+
+    // Reuse a recently freed block of exactly this size
+    front_cache_t *cache = get_heap_state()->cache;
+    if (cache != NULL && asize <= MM_CACHE_MAX) {
+        block = cache_pop(cache, asize);
+        if (block != NULL) {
+            bp = header_to_payload(block);
+            dbg_ensures(mm_checkheap(__LINE__));
+            return bp;
+        }
+    }
+
+    // Search the free list for a fit
+    index_prepare();
+    block = find_fit_flushed(asize);
+
+    // If the wilderness cannot take the request either, take back the
+    // headroom realloc reserved before the heap grows
+    headroom_t *headroom = get_heap_state()->headroom;
+    if (block == NULL && headroom != NULL) {
+        block_t *wilderness = get_heap_state()->wilderness;
+        size_t wild_size = (wilderness != NULL) ? get_size(wilderness) : 0;
+        if (wild_size < asize && headroom_release(headroom) > 0) {
+            block = find_fit(asize);
+        }
+    }
+
+    // If no fit is found, carve the block from the wilderness, requesting
+    // more memory first if the wilderness is too small
+    if (block == NULL) {
+        block_t *wilderness = get_heap_state()->wilderness;
+        size_t wild_size = (wilderness != NULL) ? get_size(wilderness) : 0;
+
+        if (wild_size < asize) {
+            // Always request at least chunksize
+            extendsize = max(asize, chunksize);
+            // extend_heap returns an error
+            if (extend_heap(extendsize) == NULL) {
+                return bp;
+            }
+        }
+
+        block = alloc_wilderness(asize);
+        bp = header_to_payload(block);
+
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    dbg_assert(!get_alloc(block));
+
+    // Place large requests at the back of the block
+    if (asize >= split_threshold && get_size(block) - asize >= min_block_size) {
+        remove_free(block);
+        block = split_block_back(block, asize);
+        bp = header_to_payload(block);
+
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // Mark block as allocated
+    remove_free(block);
+    
+    size_t block_size = get_size(block);
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_mini = get_prev_mini(block);
+
+    write_pack(block, block_size, true, prev_alloc, prev_mini);
+
     block_t *next = find_next(block);
-    bool is_mini = get_prev_mini(next);
+    write_prev_alloc(next, true);
 
-    if (!curr_alloc && !is_mini && (header != footer)) {
-        dbg_printf("Header and footer do not match.\n");
-        dbg_printf("The block is %p\n", (void *)block);
-        return false;
+    block_t *temp = split_block(block, asize);
+    if (temp != NULL) {
+        coalesce_block(temp);
     }
 
-    return true;
+    bp = header_to_payload(block);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
 }
 
 /**
- * @brief
- * Checks if the block size is valid
+ * @brief Allocates size bytes: malloc_locked under the heap lock
+ *
+ * @param[in] size The number of bytes to store on the heap
+ * @return The location of the payload, or NULL if the allocation fails
  */
+void *malloc(size_t size) {
+    heap_lock();
+    void *bp = malloc_locked(size);
+    sample_tick();
+    heap_unlock();
+    return bp;
+}
 
-static bool check_block_size(block_t *block) {
+/**
+ * @brief Frees the block with the bp payload address, and coalesces this block
+ * with its neighbor free blocks if possible
+ *
+ * @param[in] bp The payload address of the block to be freed
+ */
+static void free_locked(void *bp) {
+    dbg_requires(mm_checkheap(__LINE__));
 
-    size_t size = get_size(block);
+    if (bp == NULL) {
+        return;
+    }
 
-    if ((size < min_block_size) || (size % 16 != 0)) {
-        dbg_printf("Invalid block size at %p\n", (void *)block);
-        return false;
+    // A quarantined heap leaks rather than reuse memory
+    sampler_t *sampler = get_heap_state()->sampler;
+    if (sampler != NULL && sampler->quarantined) {
+        return;
     }
 
-    return true;
+    // Objects in the small-object region have no header
+    if (is_small_object(bp)) {
+        small_free(bp);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    block_t *block = payload_to_header(bp);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+
+    // Its headroom, if any, goes with it
+    headroom_t *headroom = get_heap_state()->headroom;
+    if (headroom != NULL) {
+        headroom_forget(headroom, block);
+    }
+
+    // Keep small blocks for a later request of the same size
+    front_cache_t *cache = get_heap_state()->cache;
+    if (cache != NULL && cache_push(cache, block, get_size(block))) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    // Leave the rest to the next flush of the free buffer
+    free_buffer_t *buffer = get_heap_state()->buffer;
+    if (buffer != NULL) {
+        buffer_push(buffer, block);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    size_t block_size = get_size(block);
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_mini = get_prev_mini(block);
+
+    write_pack(block, block_size, false, prev_alloc, prev_mini);
+
+    block_t *next = find_next(block);
+    write_prev_alloc(next, false);
+
+    // Try to coalesce the block with its neighbors
+    coalesce_block(block);
+
+    dbg_ensures(mm_checkheap(__LINE__));
 }
 
 /**
- * @brief
- * Checks if the heap is valid
+ * @brief Frees a block: free_locked under the heap lock
+ *
+ * @param[in] bp The payload address of the block to be freed
  */
+void free(void *bp) {
+    heap_lock();
+    free_locked(bp);
+    sample_tick();
+    heap_unlock();
+}
 
-static bool general_heap_checker(void) {
-    dbg_requires(heap_start != NULL);
+/**
+ * @brief Frees a block whose size the caller knows. The block size follows
+ * from the size, so a block the front cache or the free buffer takes is
+ * freed without reading its header; the rest go through free_locked, which
+ * needs the previous block's status bits from the header to coalesce.
+ *
+ * Blocks holding realloc headroom are the only ones larger than the size
+ * implies, and are looked up in the headroom table.
+ *
+ * @param[in] bp The payload address of the block to be freed, or NULL
+ * @param[in] size The size it was allocated or last resized with
+ */
+static void free_sized_locked(void *bp, size_t size) {
+    if (bp == NULL || is_small_object(bp)) {
+        dbg_assert(bp == NULL || size <= small_page_of(bp)->slot_size);
+        free_locked(bp);
+        return;
+    }
 
-    if (!check_prologue_epilogue()) {
-        return false;
+    heap_state_t *state = get_heap_state();
+    block_t *block = payload_to_header(bp);
+    size_t asize = round_up(size + wsize, dsize);
+
+    headroom_t *headroom = state->headroom;
+    sampler_t *sampler = state->sampler;
+    if ((headroom != NULL &&
+         headroom_find(headroom, block) < MM_HEADROOM_SLOTS) ||
+        (sampler != NULL && sampler->quarantined)) {
+        free_locked(bp);
+        return;
     }
 
-    block_t *curr = heap_start;
-    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+    dbg_requires(mm_checkheap(__LINE__));
+    dbg_assert(get_alloc(block));
+    dbg_assert(get_size(block) == asize);
 
-    while (curr != epilogue) {
+    front_cache_t *cache = state->cache;
+    if (cache != NULL && cache_push(cache, block, asize)) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
 
-        if (!check_alignment(curr)) {
-            return false;
-        }
+    free_buffer_t *buffer = state->buffer;
+    if (buffer != NULL) {
+        buffer_push(buffer, block);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
 
-        if (!check_boundary(curr)) {
-            return false;
-        }
+    free_locked(bp);
+}
 
-        if (!check_block_size(curr)) {
-            return false;
+/**
+ * @brief Frees a block of known size: free_sized_locked under the heap
+ * lock
+ *
+ * @param[in] bp The payload address of the block to be freed, or NULL
+ * @param[in] size The size it was allocated or last resized with
+ */
+void mm_free_sized(void *bp, size_t size) {
+    heap_lock();
+    free_sized_locked(bp, size);
+    sample_tick();
+    heap_unlock();
+}
+
+/**
+ * @brief Records that a block realloc just grew needs asize of its bytes,
+ * and holds the rest as headroom. Taking an entry from the oldest block
+ * gives that block's headroom back to the free lists.
+ *
+ * @param[in] block The block
+ * @param[in] asize The size its data needs
+ */
+static void headroom_record(block_t *block, size_t asize) {
+    heap_state_t *state = get_heap_state();
+    headroom_t *table = state->headroom;
+
+    if (get_size(block) - asize < min_block_size) {
+        if (table != NULL) {
+            headroom_forget(table, block);
         }
+        return;
+    }
 
-        if (!check_header_footer_match(curr)) {
-            return false;
+    if (table == NULL) {
+        table = malloc_locked(sizeof(headroom_t));
+        if (table == NULL) {
+            shrink_in_place(block, asize);
+            return;
+        }
+        for (size_t i = 0; i < MM_HEADROOM_SLOTS; i++) {
+            table->blocks[i] = NULL;
         }
+        table->next = 0;
+        state->headroom = table;
+    }
 
-        if (!check_non_consecutive_free(curr)) {
-            return false;
+    size_t i = headroom_find(table, block);
+    if (i == MM_HEADROOM_SLOTS) {
+        i = table->next;
+        table->next = (i + 1) % MM_HEADROOM_SLOTS;
+        if (table->blocks[i] != NULL) {
+            shrink_in_place(table->blocks[i], table->need[i]);
         }
+        table->blocks[i] = block;
+    }
+    table->need[i] = asize;
+}
 
-        curr = find_next(curr);
+/**
+ * @brief Moves the data of an allocated block to a new block and frees the
+ * old one
+ *
+ * @param[in] ptr The payload address of the block
+ * @param[in] alloc_size The payload size to allocate, or at least size if
+ * that fails
+ * @param[in] size The number of bytes the data needs, at most alloc_size
+ * @return The location of the new payload, or NULL if no block can be
+ * allocated
+ */
+static void *realloc_move(void *ptr, size_t alloc_size, size_t size) {
+    size_t copysize;
+    void *newptr = malloc_locked(alloc_size);
+    if (newptr == NULL && alloc_size > size) {
+        newptr = malloc_locked(size);
     }
 
-    return true;
+    // If malloc fails, the original block is left untouched
+    if (newptr == NULL) {
+        return NULL;
+    }
+
+    // Copy the old data
+    if (is_small_object(ptr)) {
+        copysize = small_page_of(ptr)->slot_size;
+    } else {
+        copysize = get_size(payload_to_header(ptr)) - wsize; // old payload
+    }
+    if (size < copysize) {
+        copysize = size;
+    }
+    memcpy(newptr, ptr, copysize);
+
+    // Free the old block
+    free_locked(ptr);
+
+    return newptr;
 }
 
 /**
- * @brief
- * Checks if the segregated list is valid
+ * @brief Changes the size of a block that is already allocated and reallocates
+ * it with at least size bytes of data
+ *
+ * @param[in] ptr The payload address of the block to be reallocated
+ * @param[in] size The number of bytes to be reallocated
+ * @return The location of the block that is newly reallocated
  */
+static void *realloc_locked(void *ptr, size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
 
-static bool check_list(void) {
+    block_t *block = payload_to_header(ptr);
+    void *newptr;
 
-    for (size_t i = 0; i < LENGTH; i++) {
-        block_t *curr = seg_list[i];
+    // If size == 0, then free block and return NULL
+    if (size == 0) {
+        free_locked(ptr);
+        return NULL;
+    }
 
-        while (curr != NULL) {
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL) {
+        return malloc_locked(size);
+    }
 
-            /* Checks if the free list pointer is between mem_heap_lo() and
-            mem_heap_high() */
-            if ((void *)curr > mem_heap_hi()) {
-                dbg_printf("Block out of upper bound %p\n", (void *)curr);
-                return false;
-            }
+    // A quarantined heap moves every block to fresh memory and leaks the
+    // old one, since growing or shrinking in place would reuse its
+    // neighbours
+    sampler_t *sampler = get_heap_state()->sampler;
+    if (sampler != NULL && sampler->quarantined) {
+        return realloc_move(ptr, size, size);
+    }
 
-            if ((void *)curr < mem_heap_lo()) {
-                dbg_printf("Block out of lower bound %p\n", (void *)curr);
-                return false;
-            }
+    // A small object stays in its slot while it fits
+    if (is_small_object(ptr)) {
+        if (size <= small_page_of(ptr)->slot_size) {
+            return ptr;
+        }
+        return realloc_move(ptr, size, size);
+    }
 
-            /* Checks if the next/previous pointers are consistent */
-            block_t *next = curr->payload.next;
-            if (next != NULL) {
-                bool is_prev = (next->payload.prev == curr);
-                if (!is_prev) {
-                    dbg_printf("Next/previous pointers are not consistent.\n");
-                    dbg_printf("The block is %p\n", (void *)curr);
-                    dbg_printf("The next block is %p\n", (void *)next);
-                    return false;
-                }
-            }
+    size_t asize = round_up(size + wsize, dsize);
+    size_t block_size = get_size(block);
+    headroom_t *headroom = get_heap_state()->headroom;
+    size_t entry = (headroom != NULL) ? headroom_find(headroom, block)
+                                      : MM_HEADROOM_SLOTS;
+
+    // Growth into the block's headroom
+    if (entry < MM_HEADROOM_SLOTS && asize <= block_size &&
+        asize >= headroom->need[entry]) {
+        headroom->need[entry] = asize;
+        return ptr;
+    }
 
-            /* Checks if the block falls within the desired bucket size range */
-            size_t class = find_class(get_size(curr));
-            if (class != i) {
-                dbg_printf("The block is not in the desired list bucket.\n");
-                dbg_printf("The block is %p\n", (void *)curr);
-                return false;
-            }
+    // Shrink in place, freeing the tail
+    if (asize <= block_size) {
+        if (entry < MM_HEADROOM_SLOTS) {
+            headroom->blocks[entry] = NULL;
+        }
+        shrink_in_place(block, asize);
+        return ptr;
+    }
+
+    // A block grown before gets headroom for the next growth
+    size_t target = asize;
+    if (MM_REALLOC_HEADROOM > 0 && get_grown(block)) {
+        target = headroom_size(asize);
+    }
+
+    // Grow in place into the free block after it
+    if (grow_in_place(block, target) ||
+        (target > asize && grow_in_place(block, asize))) {
+        write_grown(block);
+        if (target > asize) {
+            headroom_record(block, asize);
+        }
+        return ptr;
+    }
+
+    // Grow down into the free block before it
+    block_t *grown = grow_backward(block, target);
+    if (grown == NULL && target > asize) {
+        grown = grow_backward(block, asize);
+    }
+    if (grown != NULL) {
+        // The old address now lies inside the payload of the grown block
+        if (entry < MM_HEADROOM_SLOTS) {
+            headroom->blocks[entry] = NULL;
+        }
+        write_grown(grown);
+        if (target > asize) {
+            headroom_record(grown, asize);
+        }
+        return header_to_payload(grown);
+    }
+
+    // Grow a large block that no free block can take by moving its pages
+    // to the end of the heap instead of copying them
+    if (block_size - wsize >= MM_REMAP_MIN && find_fit_flushed(asize) == NULL) {
+        block_t *new_block = remap_block(block, asize);
+        if (new_block == NULL) {
+            return NULL;
+        }
+        free_locked(ptr);
+        write_grown(new_block);
+        return header_to_payload(new_block);
+    }
+
+    // Otherwise, move the data to a new block
+    newptr = realloc_move(ptr, target - wsize, size);
+    if (newptr != NULL && !is_small_object(newptr)) {
+        block = payload_to_header(newptr);
+        write_grown(block);
+        if (target > asize) {
+            headroom_record(block, asize);
+        }
+    }
+    return newptr;
+}
+
+/**
+ * @brief Resizes a block: realloc_locked under the heap lock
+ *
+ * @param[in] ptr The payload address of the block, or NULL
+ * @param[in] size The new size
+ * @return The location of the new payload, or NULL
+ */
+void *realloc(void *ptr, size_t size) {
+    heap_lock();
+    void *bp = realloc_locked(ptr, size);
+    sample_tick();
+    heap_unlock();
+    return bp;
+}
+
+/**
+ * @brief Array version of malloc with each element of size bytes, while 
+ * initializing all memory bytes to zero
+ *
+ * @param[in] elements The number of elements to be allocated
+ * @param[in] size The size of each element
+ * @return The location of the payload of the allocated block, otherwise NULL
+ * if the allocation fails
+ */
+static void *calloc_locked(size_t elements, size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    void *bp;
+    size_t asize = elements * size;
+
+    if (elements == 0) {
+        return NULL;
+    }
+    if (asize / elements != size) {
+        // Multiplication overflowed
+        return NULL;
+    }
 
-            curr = curr->payload.next;
-        }
+    bp = malloc_locked(asize);
+    if (bp == NULL) {
+        return NULL;
     }
 
+    // Initialize all bits to 0
+    memset(bp, 0, asize);
 
-    return true;
+    return bp;
 }
 
 /**
- * @brief Overall heap cheacker than tracks heap performance and checks for
- * invariants
+ * @brief Allocates a zeroed array: calloc_locked under the heap lock
  *
- * @param[in] line The line where the assertion failure raises, given the
- * function returns false
- * @return true if the heap check passes, and false otherwise
+ * @param[in] elements The number of elements
+ * @param[in] size The size of each element
+ * @return The location of the payload, or NULL if the allocation fails
  */
-bool mm_checkheap(int line) {
+void *calloc(size_t elements, size_t size) {
+    heap_lock();
+    void *bp = calloc_locked(elements, size);
+    sample_tick();
+    heap_unlock();
+    return bp;
+}
 
-    if (!general_heap_checker()) {
-        return false;
+/**
+ * @brief Allocates a block whose payload is aligned to align bytes.
+ *
+ * Payloads are dsize aligned, so in a block of align extra bytes an aligned
+ * payload starts a multiple of dsize, at most align - dsize, past the first
+ * one. The bytes before it become a free block of their own, and the at
+ * least dsize bytes behind it a second one, leaving a block of exactly
+ * round_up(size + wsize, dsize) bytes as malloc would, which mm_free_sized
+ * relies on. A quarantined heap leaks the front and keeps the rest instead.
+ *
+ * @param[in] align The alignment, a power of two
+ * @param[in] size The number of bytes to store on the heap
+ * @return The location of the payload, or NULL if align is not a power of
+ * two or the allocation fails
+ */
+static void *aligned_alloc_locked(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= dsize) {
+        return malloc_locked(size);
+    }
+    if (size == 0 || size > SIZE_MAX - align - 2 * dsize) {
+        return NULL;
     }
 
-    if (!check_list()) {
-        return false;
+    // Stay above the small-object sizes, whose slots have no header
+    size_t asize = round_up(size + wsize, dsize);
+    size_t request = max(asize - wsize + align, MM_SMALL_MAX + 1);
+    void *bp = malloc_locked(request);
+    if (bp == NULL) {
+        return NULL;
     }
 
-    return true;
-}
+    sampler_t *sampler = get_heap_state()->sampler;
+    bool quarantined = (sampler != NULL && sampler->quarantined);
+    block_t *block = payload_to_header(bp);
+    size_t front = round_up((uintptr_t)bp, align) - (uintptr_t)bp;
+
+    if (front > 0) {
+        size_t block_size = get_size(block);
+        bool prev_alloc = get_prev_alloc(block);
+        bool prev_mini = get_prev_mini(block);
+
+        write_pack(block, front, quarantined, prev_alloc, prev_mini);
+        block_t *aligned = find_next(block);
+        write_pack(aligned, block_size - front, true, quarantined,
+                   front == min_block_size);
 
+        if (!quarantined) {
+            coalesce_block(block);
+        }
+        block = aligned;
+    }
+
+    if (!quarantined) {
+        block_t *rest = split_block(block, asize);
+        if (rest != NULL) {
+            coalesce_block(rest);
+        }
+    }
 
+    dbg_ensures(mm_checkheap(__LINE__));
+    return header_to_payload(block);
+}
 
 /**
- * @brief Initializes the heap, segregated free list, and mini list
- * @return true if the initialization succeeds, and false otherwise
+ * @brief Allocates an aligned block: aligned_alloc_locked under the heap
+ * lock
+ *
+ * @param[in] align The alignment, a power of two
+ * @param[in] size The number of bytes to store on the heap
+ * @return The location of the payload, or NULL if the allocation fails
  */
+void *mm_aligned_alloc(size_t align, size_t size) {
+    heap_lock();
+    void *bp = aligned_alloc_locked(align, size);
+    sample_tick();
+    heap_unlock();
+    return bp;
+}
 
-bool mm_init(void) {
+/**
+ * @brief Returns the number of bytes of an allocated payload the caller may
+ * use: the slot size of a small object, the size realloc last asked for of
+ * a block holding headroom, and the block size less the header otherwise
+ *
+ * @param[in] bp The payload address of an allocated block, or NULL
+ * @return The usable size, or 0 for NULL
+ */
+size_t mm_usable_size(void *bp) {
+    if (bp == NULL) {
+        return 0;
+    }
 
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+    heap_lock();
+    size_t usable;
+    if (is_small_object(bp)) {
+        usable = small_page_of(bp)->slot_size;
+    } else {
+        block_t *block = payload_to_header(bp);
+        dbg_assert(get_alloc(block));
+
+        /* Headroom is not the caller's: it may be taken back */
+        headroom_t *headroom = get_heap_state()->headroom;
+        size_t entry = (headroom != NULL) ? headroom_find(headroom, block)
+                                          : MM_HEADROOM_SLOTS;
+        if (entry < MM_HEADROOM_SLOTS) {
+            usable = headroom->need[entry] - wsize;
+        } else {
+            usable = get_size(block) - wsize;
+        }
+    }
+    heap_unlock();
+    return usable;
+}
 
-    if (start == (void *)-1) {
-        return false;
+/**
+ * @brief Returns the request size that exactly fills the block malloc
+ * would choose for size bytes: the slot size when the small-object region
+ * takes the request, and otherwise the payload of a block of
+ * round_up(size + wsize, dsize) bytes
+ *
+ * @param[in] size The number of bytes needed
+ * @return The good size, at least size, or size if no block can hold it
+ */
+size_t mm_good_size(size_t size) {
+    if (size > SIZE_MAX - 2 * dsize) {
+        return size;
+    }
+    if (size == 0) {
+        size = 1;
     }
 
-    /* Initialize segregated free list */
-    for (size_t i = 0; i < LENGTH; i++) {
-        seg_list[i] = NULL;
+    bool small = (heap_start != NULL) ? get_heap_state()->small_objects
+                                      : MM_SMALL_OBJECTS;
+    if (small && size <= MM_SMALL_MAX) {
+        return round_up(size, dsize);
     }
 
-    /* Initialize the mini-block list */
-    mini_list = NULL;
+    return round_up(size + wsize, dsize) - wsize;
+}
 
-    start[0] = pack_all(0, true, false, false); // Heap prologue (block footer)
-    start[1] = pack_all(0, true, true, false); // Heap epilogue (block header)
+/*
+ * ---------------------------------------------------------------------------
+ *                               ARENAS
+ * ---------------------------------------------------------------------------
+ */
 
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
+/**
+ * @brief Creates an empty arena. Its chunks are allocated lazily.
+ *
+ * @return The new arena, or NULL if it cannot be allocated
+ */
 
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL) {
-        return false;
+mm_arena_t *mm_arena_create(void) {
+    mm_arena_t *arena = malloc(sizeof(mm_arena_t));
+    if (arena == NULL) {
+        return NULL;
     }
 
-    return true;
+    arena->chunks = NULL;
+    arena->cur = NULL;
+    arena->end = NULL;
+    return arena;
 }
 
-
 /**
- * @brief The fundamental dynamic memory allocator that allocates size bytes
- * of date on the heap
+ * @brief Allocates size bytes from an arena, aligned to dsize.
  *
- * @param[in] size The number of bytes to store on the heap
- * @return The location of the payload of the allocated block, otherwise NULL
- * if the allocation fails
+ * Requests are bump-allocated from the newest regular chunk. When it is
+ * full, a new regular chunk is taken from the heap; a
+ * request too large to share a chunk gets a dedicated one, and the regular
+ * chunk stays in use.
+ *
+ * @param[in] arena The arena to allocate from
+ * @param[in] size The number of bytes needed
+ * @return The allocated memory, or NULL if size is 0 or the heap is out of
+ * memory
  */
 
-void *malloc(size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
+void *mm_arena_alloc(mm_arena_t *arena, size_t size) {
+    dbg_requires(arena != NULL);
 
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
+    if (size == 0) {
+        return NULL;
+    }
 
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        if (!(mm_init())) {
-            dbg_printf("Problem initializing heap. Likely due to sbrk");
-            return NULL;
-        }
+    size_t asize = round_up(size, dsize);
+    if (asize < size) {
+        return NULL;
     }
 
-    // Ignore spurious request
-    if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+    /* Common case: bump */
+    if (asize <= (size_t)(arena->end - arena->cur)) {
+        void *p = arena->cur;
+        arena->cur += asize;
+        return p;
     }
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + wsize, dsize);
+    size_t chunk_size = arena_chunksize;
+    size_t dedicated = (chunk_size - sizeof(chunk_t)) / 4;
+    if (asize > dedicated) {
+        chunk_size = sizeof(chunk_t) + asize;
+    }
 
-    // Search the free list for a fit
-    block = find_fit(asize);
+    chunk_t *chunk = malloc(chunk_size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->size = chunk_size;
 
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL) {
-            return bp;
-        }
+    /* Dedicated chunks go behind the regular chunk being bumped */
+    if (asize > dedicated && arena->chunks != NULL) {
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+        return chunk->data;
     }
 
-    dbg_assert(!get_alloc(block));
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
 
-    // Mark block as allocated
-    remove_free(block);
-    
-    size_t block_size = get_size(block);
-    bool prev_alloc = get_prev_alloc(block);
-    bool prev_mini = get_prev_mini(block);
+    if (asize > dedicated) {
+        return chunk->data;
+    }
 
-    write_pack(block, block_size, true, prev_alloc, prev_mini);
+    arena->cur = chunk->data + asize;
+    arena->end = (char *)chunk + chunk_size;
+    return chunk->data;
+}
 
-    block_t *next = find_next(block);
-    write_prev_alloc(next, true);
+/**
+ * @brief Frees everything allocated from an arena, keeping the newest
+ * regular chunk for reuse
+ *
+ * @param[in] arena The arena to reset
+ */
 
-    block_t *temp = split_block(block, asize);
-    if (temp != NULL) {
-        coalesce_block(temp);
-    }
+void mm_arena_reset(mm_arena_t *arena) {
+    dbg_requires(arena != NULL);
 
-    bp = header_to_payload(block);
+    chunk_t *keep = NULL;
+    chunk_t *chunk = arena->chunks;
 
-    dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+    while (chunk != NULL) {
+        chunk_t *next = chunk->next;
+        if (keep == NULL && chunk->size == arena_chunksize) {
+            keep = chunk;
+        } else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+
+    arena->chunks = keep;
+    if (keep != NULL) {
+        keep->next = NULL;
+        arena->cur = keep->data;
+        arena->end = (char *)keep + keep->size;
+    } else {
+        arena->cur = NULL;
+        arena->end = NULL;
+    }
 }
 
 /**
- * @brief Frees the block with the bp payload address, and coalesces this block
- * with its neighbor free blocks if possible
+ * @brief Frees an arena and everything allocated from it
  *
- * @param[in] bp The payload address of the block to be freed
+ * @param[in] arena The arena to destroy, or NULL
  */
-void free(void *bp) {
-    dbg_requires(mm_checkheap(__LINE__));
 
-    if (bp == NULL) {
+void mm_arena_destroy(mm_arena_t *arena) {
+    if (arena == NULL) {
         return;
     }
 
-    block_t *block = payload_to_header(bp);
+    chunk_t *chunk = arena->chunks;
+    while (chunk != NULL) {
+        chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
 
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
+    free(arena);
+}
 
-    size_t block_size = get_size(block);
-    bool prev_alloc = get_prev_alloc(block);
-    bool prev_mini = get_prev_mini(block);
+/*
+ * ---------------------------------------------------------------------------
+ *                               POOLS
+ * ---------------------------------------------------------------------------
+ */
 
-    write_pack(block, block_size, false, prev_alloc, prev_mini);
+/**
+ * @brief Creates a pool of objects of obj_size bytes, each aligned to align.
+ * Slabs are allocated lazily.
+ *
+ * @param[in] obj_size The size of every object
+ * @param[in] align The alignment, a power of two; 0 means dsize
+ * @return The new pool, or NULL if the arguments are invalid or the pool
+ * cannot be allocated
+ */
 
-    block_t *next = find_next(block);
-    write_prev_alloc(next, false);
+mm_pool_t *mm_pool_create(size_t obj_size, size_t align) {
+    if (align == 0) {
+        align = dsize;
+    }
 
-    // Try to coalesce the block with its neighbors
-    coalesce_block(block);
+    if (obj_size == 0 || (align & (align - 1)) != 0 ||
+        align > arena_chunksize / 8 || obj_size > arena_chunksize) {
+        return NULL;
+    }
 
-    dbg_ensures(mm_checkheap(__LINE__));
+    mm_pool_t *pool = malloc(sizeof(mm_pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    /* Every object must be able to hold the free list link */
+    pool->stride = round_up(max(obj_size, sizeof(void *)), align);
+    pool->align = align;
+    pool->free_obj = NULL;
+    pool->slabs = NULL;
+    pool->cur = NULL;
+    pool->end = NULL;
+    return pool;
 }
 
 /**
- * @brief Changes the size of a block that is already allocated and reallocates
- * it with at least size bytes of data
+ * @brief Allocates one object from a pool: the most recently freed one if
+ * there is one, else the next unused object of the newest slab, else the
+ * first object of a new slab
  *
- * @param[in] ptr The payload address of the block to be reallocated
- * @param[in] size The number of bytes to be reallocated
- * @return The location of the block that is newly reallocated
+ * @param[in] pool The pool to allocate from
+ * @return The object, or NULL if the heap is out of memory
  */
-void *realloc(void *ptr, size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
 
-    block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
+void *mm_pool_alloc(mm_pool_t *pool) {
+    dbg_requires(pool != NULL);
 
-    // If size == 0, then free block and return NULL
-    if (size == 0) {
-        free(ptr);
-        return NULL;
+    void *obj = pool->free_obj;
+    if (obj != NULL) {
+        pool->free_obj = *(void **)obj;
+        return obj;
     }
 
-    // If ptr is NULL, then equivalent to malloc
-    if (ptr == NULL) {
-        return malloc(size);
-    }
+    if (pool->stride > (size_t)(pool->end - pool->cur)) {
+        /* Room for the header, alignment slack and at least 8 objects */
+        size_t slab_size =
+            max(arena_chunksize,
+                sizeof(chunk_t) + pool->align + 8 * pool->stride);
 
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
+        chunk_t *slab = malloc(slab_size);
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->size = slab_size;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
 
-    // If malloc fails, the original block is left untouched
-    if (newptr == NULL) {
-        return NULL;
+        uintptr_t first = round_up((uintptr_t)slab->data, pool->align);
+        pool->cur = (char *)first;
+        pool->end = (char *)slab + slab_size;
     }
 
-    // Copy the old data
-    copysize = get_size(block) - wsize; // gets size of old payload
-    if (size < copysize) {
-        copysize = size;
-    }
-    memcpy(newptr, ptr, copysize);
+    obj = pool->cur;
+    pool->cur += pool->stride;
+    return obj;
+}
 
-    // Free the old block
-    free(ptr);
+/**
+ * @brief Checks if the given object lies in one of the slabs of a pool
+ */
 
-    return newptr;
+static bool pool_owns(mm_pool_t *pool, void *obj) {
+    for (chunk_t *slab = pool->slabs; slab != NULL; slab = slab->next) {
+        if ((char *)obj >= slab->data &&
+            (char *)obj < (char *)slab + slab->size) {
+            return true;
+        }
+    }
+    return false;
 }
 
 /**
- * @brief Array version of malloc with each element of size bytes, while 
- * initializing all memory bytes to zero
+ * @brief Returns an object to its pool
  *
- * @param[in] elements The number of elements to be allocated
- * @param[in] size The size of each element
- * @return The location of the payload of the allocated block, otherwise NULL
- * if the allocation fails
+ * @param[in] pool The pool the object was allocated from
+ * @param[in] obj The object, or NULL
  */
-void *calloc(size_t elements, size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
 
-    void *bp;
-    size_t asize = elements * size;
+void mm_pool_free(mm_pool_t *pool, void *obj) {
+    dbg_requires(pool != NULL);
 
-    if (elements == 0) {
-        return NULL;
-    }
-    if (asize / elements != size) {
-        // Multiplication overflowed
-        return NULL;
+    if (obj == NULL) {
+        return;
     }
 
-    bp = malloc(asize);
-    if (bp == NULL) {
-        return NULL;
+    dbg_requires(pool_owns(pool, obj));
+
+    *(void **)obj = pool->free_obj;
+    pool->free_obj = obj;
+}
+
+/**
+ * @brief Frees a pool together with all of its objects
+ *
+ * @param[in] pool The pool to destroy, or NULL
+ */
+
+void mm_pool_destroy(mm_pool_t *pool) {
+    if (pool == NULL) {
+        return;
     }
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    chunk_t *slab = pool->slabs;
+    while (slab != NULL) {
+        chunk_t *next = slab->next;
+        free(slab);
+        slab = next;
+    }
 
-    return bp;
+    free(pool);
 }
 
 /*
@@ -7,8 +7,13 @@
 #define MM_H__ 1
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifdef DRIVER
 
 /* declare functions for driver tests */
@@ -40,6 +45,11 @@ extern void free(void *ptr);
 /**
  * @brief  Resize an allocated block.
  *
+ * Blocks grow and shrink in place when their neighbours allow.  A block
+ * grown a second time gets headroom (MM_REALLOC_HEADROOM percent, 50 by
+ * default) that later growth uses without copying; the allocator takes it
+ * back when the heap would otherwise grow.
+ *
  * @param[in] ptr  A pointer to the beginning of the allocated payload.
  * @param[in] size  The new size of the allocated block.
  *
@@ -61,6 +71,71 @@ extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
 #endif
 
+/**
+ * @brief  Allocate memory in the heap of at least `size` bytes, aligned to
+ *         `align` bytes.
+ *
+ * The block is freed like any other, with free or mm_free_sized.  realloc
+ * keeps only the default 16-byte alignment when it moves the block.
+ *
+ * @param[in] align  The alignment: a power of two.
+ * @param[in] size   The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the aligned payload, or NULL on failure, if `size`
+ *          is 0, or if `align` is not a power of two.
+ */
+extern void *mm_aligned_alloc(size_t align, size_t size);
+
+/**
+ * @brief  Free an allocated block whose size the caller knows.
+ *
+ * Like free, but blocks bound for the front cache or the free buffer are
+ * freed without reading their header.  This only saves work with the front
+ * cache (mm_set_front_cache) or the free buffer (mm_set_deferred_free)
+ * enabled: any other block is freed into the free lists, and its header
+ * is read anyway, since it holds the allocation bits of the block before
+ * it that coalescing needs.  Debug builds check the size against the
+ * header.
+ *
+ * @param[in] ptr   A pointer to the beginning of an allocated payload, or
+ *                  NULL.
+ * @param[in] size  The size the block was allocated or last resized with,
+ *                  or any size up to its mm_usable_size that rounds to the
+ *                  same block.
+ */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/**
+ * @brief  Return how many bytes of an allocated payload may be used.
+ *
+ * This is at least the size the block was allocated or last resized to,
+ * and covers the rounding up to the block size, so a container can use
+ * the whole of it as capacity.
+ *
+ * @param[in] ptr  A pointer to the beginning of an allocated payload, or
+ *                 NULL.
+ *
+ * @return  The usable size, or 0 if `ptr` is NULL.
+ */
+extern size_t mm_usable_size(void *ptr);
+
+/**
+ * @brief  Return the request size that exactly fills the block the
+ *         allocator would choose for `size` bytes.
+ *
+ * Allocating the returned size wastes nothing to rounding: mm_usable_size
+ * of the result equals it.  Takes the current heap's settings into
+ * account, so that small requests are rounded to the slot sizes of the
+ * small-object region while it is enabled.  The setting is read without
+ * the heap lock, so like every mm_set_* option, mm_set_small_objects must
+ * not run while another thread uses the heap.
+ *
+ * @param[in] size  The number of bytes needed.
+ *
+ * @return  The good size, at least `size`.
+ */
+extern size_t mm_good_size(size_t size);
+
 /**
  * @brief  Initialize the heap.
  *
@@ -68,6 +143,376 @@ extern void *calloc(size_t nmemb, size_t size);
  */
 extern bool mm_init(void);
 
+/**
+ * @brief  Save the state needed to reopen a heap kept in a file.
+ *
+ * For a heap that memlib maps from a file (mem_init_file): stops the
+ * maintenance thread and saves the free list roots in the file's header
+ * page.  The heap must not be used afterwards; the next process calls
+ * mm_attach instead of mm_init to take it over.
+ *
+ * @return  True on success, False if there is no heap or it is not kept in
+ *          a file.
+ */
+extern bool mm_detach(void);
+
+/**
+ * @brief  Take over a heap that an earlier process saved with mm_detach.
+ *
+ * The heap is accepted only if it was saved by a build with the same size
+ * classes and link format and passes every heap check.  Payload pointers
+ * from the earlier process stay valid, since the file is mapped at the same
+ * address.  A heap whose process died without mm_detach is refused.
+ *
+ * @return  True if the heap was taken over, False otherwise.
+ */
+extern bool mm_attach(void);
+
+/**
+ * @brief  Save the heap to a file for mm_restore.
+ *
+ * Writes the used parts of the heap, from mem_heap_lo to mem_heap_hi, and
+ * the free list roots.  Of each free block only the allocator's own words
+ * are saved, so a fragmented heap makes a compact file.
+ *
+ * @param[in] path  The file to write.
+ *
+ * @return  True on success, False if there is no heap or writing fails.
+ */
+extern bool mm_snapshot(const char *path);
+
+/**
+ * @brief  Replace the heap with one saved by mm_snapshot.
+ *
+ * The heap is rebuilt at the address it was saved from, so every pointer
+ * into it is valid again; this needs a build with the same size classes
+ * and link format, and a dense heap (mem_init) at the same base, which
+ * memlib asks for on every run.  The restored heap must pass every heap
+ * check.  Stops the maintenance thread.
+ *
+ * @param[in] path  The snapshot.
+ *
+ * @return  True on success, False otherwise, in which case the heap is
+ *          left empty and the next allocation starts a new one.
+ */
+extern bool mm_restore(const char *path);
+
+/**
+ * @brief  Record the payload from which the application reaches the rest
+ *         of its data in a heap kept in a file.
+ *
+ * The root is saved in the file, so after mm_attach it leads back to the
+ * data an earlier process left in the heap.  mm_init clears it.
+ *
+ * @param[in] ptr  A payload in the heap, or NULL.
+ *
+ * @return  True on success, False if the heap is not kept in a file.
+ */
+extern bool mm_set_root(void *ptr);
+
+/**
+ * @brief  Return the payload last passed to mm_set_root.
+ *
+ * @return  The root, or NULL if none was set or the heap is not kept in a
+ *          file.
+ */
+extern void *mm_get_root(void);
+
+/** @brief Strategies find_fit can use to pick a free block */
+typedef enum {
+    MM_FIT_FIRST, /**< First block that fits */
+    MM_FIT_NEXT,  /**< First fit, resuming where the last search stopped */
+    MM_FIT_BEST,  /**< Smallest block that fits in the first nonempty class */
+    MM_FIT_GOOD   /**< Best of the blocks seen until k fail to improve on it */
+} mm_fit_policy_t;
+
+/**
+ * @brief  Select the fit policy for the current heap.
+ *
+ * mm_init resets the policy to the compile-time default (MM_FIT_POLICY),
+ * so call this after every mm_init.
+ *
+ * Blocks of up to MM_EXACT_MAX bytes (1 KiB by default) have free lists of
+ * one size each, and a request is served from the first non-empty one that
+ * fits before any policy runs, since every block in it fits equally well.
+ * The policies therefore differ only for larger requests, and for smaller
+ * ones when every exact-size list that fits is empty.
+ *
+ * @param[in] policy  The policy to use.
+ * @param[in] k  Number of non-improving candidates MM_FIT_GOOD tolerates;
+ *               ignored by the other policies.
+ *
+ * @return  True on success, False if the heap is not initialized or the
+ *          arguments are invalid.
+ */
+extern bool mm_set_fit_policy(mm_fit_policy_t policy, unsigned int k);
+
+/** @brief Orders the segregated free lists can be kept in */
+typedef enum {
+    MM_LIST_LIFO,   /**< Freed blocks go to the head of their list */
+    MM_LIST_ADDRESS /**< Lists are sorted by block address */
+} mm_list_order_t;
+
+/**
+ * @brief  Select the free list order for the current heap.
+ *
+ * mm_init resets the order to the compile-time default (MM_LIST_ORDER),
+ * so call this after every mm_init.  The list of minimum-size blocks is
+ * always LIFO.
+ *
+ * @param[in] order  The order to keep the lists in.
+ *
+ * @return  True on success, False if the heap is not initialized or the
+ *          order is invalid.
+ */
+extern bool mm_set_list_order(mm_list_order_t order);
+
+/** @brief A region that objects are bump-allocated from and freed with */
+typedef struct mm_arena mm_arena_t;
+
+/**
+ * @brief  Create an empty arena.
+ *
+ * @return  The arena, or NULL if it cannot be allocated.
+ */
+extern mm_arena_t *mm_arena_create(void);
+
+/**
+ * @brief  Allocate `size` bytes from an arena.
+ *
+ * The memory is 16-byte aligned and cannot be freed on its own; it is
+ * released by mm_arena_reset or mm_arena_destroy.
+ *
+ * @param[in] arena  The arena to allocate from.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the allocated bytes, or NULL on failure or if
+ *          `size` is 0.
+ */
+extern void *mm_arena_alloc(mm_arena_t *arena, size_t size);
+
+/**
+ * @brief  Free everything allocated from an arena, keeping it usable.
+ *
+ * @param[in] arena  The arena to reset.
+ */
+extern void mm_arena_reset(mm_arena_t *arena);
+
+/**
+ * @brief  Free an arena and everything allocated from it.
+ *
+ * @param[in] arena  The arena to destroy, or NULL.
+ */
+extern void mm_arena_destroy(mm_arena_t *arena);
+
+/** @brief A pool of objects of one size with O(1) allocation and free */
+typedef struct mm_pool mm_pool_t;
+
+/**
+ * @brief  Create a pool of fixed-size objects.
+ *
+ * @param[in] obj_size  The size of every object, at most 4 KiB.
+ * @param[in] align  The alignment of every object: a power of two of at
+ *                   most 256, or 0 for the 16-byte default.
+ *
+ * @return  The pool, or NULL on failure or invalid arguments.
+ */
+extern mm_pool_t *mm_pool_create(size_t obj_size, size_t align);
+
+/**
+ * @brief  Allocate one object from a pool.
+ *
+ * @param[in] pool  The pool to allocate from.
+ *
+ * @return  A pointer to the object, or NULL on failure.
+ */
+extern void *mm_pool_alloc(mm_pool_t *pool);
+
+/**
+ * @brief  Return an object to the pool it was allocated from.
+ *
+ * @param[in] pool  The pool the object came from.
+ * @param[in] ptr  The object, or NULL.
+ */
+extern void mm_pool_free(mm_pool_t *pool, void *ptr);
+
+/**
+ * @brief  Free a pool and every object allocated from it.
+ *
+ * @param[in] pool  The pool to destroy, or NULL.
+ */
+extern void mm_pool_destroy(mm_pool_t *pool);
+
+/**
+ * @brief  Enable or disable the small-object region for the current heap.
+ *
+ * Requests of up to MM_SMALL_MAX bytes (64 by default) are then served from
+ * pages of equal-sized slots without per-object headers.  The slot size
+ * and an allocation bitmap of every page are kept in the region header,
+ * apart from the slots, so overrunning a slot cannot corrupt the allocator.
+ * mm_init resets the setting to the compile-time default
+ * (MM_SMALL_OBJECTS).
+ *
+ * @param[in] enable  Whether to use the region for new small requests.
+ *
+ * @return  True on success, False if the heap is not initialized.
+ */
+extern bool mm_set_small_objects(bool enable);
+
+/**
+ * @brief  Enable or disable the size index for the current heap.
+ *
+ * The index keeps the sizes of the free blocks in the larger classes in
+ * dense arrays, which the best-fit policy (MM_FIT_BEST) then scans instead
+ * of walking the free lists.  The arrays are allocated from the heap and
+ * grow with the lists.  mm_init disables the index.
+ *
+ * @param[in] enable  Whether to keep the index.
+ *
+ * @return  True on success, False if the heap is not initialized or has no
+ *          room for the index.
+ */
+extern bool mm_set_size_index(bool enable);
+
+/**
+ * @brief  Enable or disable the front cache for the current heap.
+ *
+ * Freed blocks of up to MM_CACHE_MAX bytes (256 by default) are then kept,
+ * up to MM_CACHE_DEPTH of each size, and handed straight back to the next
+ * request of the same size without touching the free lists.  Disabling
+ * frees the cached blocks.  mm_init resets the setting to the compile-time
+ * default (MM_FRONT_CACHE).
+ *
+ * @param[in] enable  Whether to keep the cache.
+ *
+ * @return  True on success, False if the heap is not initialized or has no
+ *          room for the cache.
+ */
+extern bool mm_set_front_cache(bool enable);
+
+/**
+ * @brief  Enable or disable the free buffer for the current heap.
+ *
+ * Frees of blocks the front cache does not keep are then collected in a
+ * buffer of MM_FREE_BUFFER blocks (64 by default).  When it fills up, or
+ * when an allocation finds no fit, the buffer is sorted by address and
+ * every run of adjacent blocks is freed and coalesced as one.  Disabling
+ * carries out the buffered frees.  mm_init resets the setting to the
+ * compile-time default (MM_DEFER_FREES).
+ *
+ * @param[in] enable  Whether to keep the buffer.
+ *
+ * @return  True on success, False if the heap is not initialized or has no
+ *          room for the buffer.
+ */
+extern bool mm_set_deferred_free(bool enable);
+
+/** @brief Work done by mm_maintain since mm_init */
+typedef struct {
+    size_t slices;         /* Calls to mm_maintain */
+    size_t flushed_blocks; /* Cached or buffered blocks freed */
+    size_t purged_bytes;   /* Free block pages given back to the system */
+    size_t trimmed_bytes;  /* Pages at the top of the heap given back */
+} mm_maint_stats_t;
+
+/**
+ * @brief  Run one bounded slice of heap maintenance.
+ *
+ * Returns the blocks held by the front cache and the free buffer to the
+ * free lists, takes back the headroom realloc reserved for growing blocks,
+ * then gives
+ * the pages of free blocks of at least MM_PURGE_MIN bytes (64 KiB by
+ * default) back to the system, including the top of the heap beyond the
+ * heap extension size.  Successive slices resume at the size class where
+ * the last one stopped, and blocks purged already cost nothing.  The heap
+ * never shrinks: purged pages stay part of it and read as zero when reused.
+ *
+ * @param[in] budget  The most blocks to free or purge.
+ *
+ * @return  The number of blocks freed or purged.
+ */
+extern size_t mm_maintain(size_t budget);
+
+/**
+ * @brief  Read the counters of the work done by mm_maintain.
+ *
+ * @param[out] stats  Where to store the counters.
+ */
+extern void mm_get_maint_stats(mm_maint_stats_t *stats);
+
+/**
+ * @brief  Start a thread that runs mm_maintain in the background.
+ *
+ * The thread runs a slice every `period_ms` milliseconds, whenever the heap
+ * grows, and on mm_background_wake.  While it runs, every allocator call
+ * takes a heap lock.  Only builds with MM_BACKGROUND set (and -pthread)
+ * have the thread.  Select the mm_set_* options before starting it, and
+ * stop it before calling mm_init again.
+ *
+ * @param[in] period_ms  Time between slices when nothing wakes the thread.
+ * @param[in] budget     Budget of each slice; must be positive.
+ *
+ * @return  True on success, False if the heap is not initialized, the
+ *          thread is already running, or the build lacks it.
+ */
+extern bool mm_background_start(unsigned int period_ms, size_t budget);
+
+/**
+ * @brief  Stop the maintenance thread, if it is running.
+ */
+extern void mm_background_stop(void);
+
+/**
+ * @brief  Ask the maintenance thread, if it is running, for a slice now.
+ */
+extern void mm_background_wake(void);
+
+/** @brief What the sampled heap checker does when it finds corruption */
+typedef enum {
+    MM_CHECK_ABORT,     /* Report it and abort */
+    MM_CHECK_QUARANTINE /* Report it and stop reusing freed memory */
+} mm_check_action_t;
+
+/** @brief Counters of the sampled heap checker */
+typedef struct {
+    uint64_t ops;        /* Allocator calls counted */
+    uint64_t checks;     /* Runs of the checker */
+    uint64_t inspected;  /* Blocks and free list nodes checked */
+    uint64_t corrupt_op; /* Call after which corruption was found, or 0 */
+} mm_check_stats_t;
+
+/**
+ * @brief  Enable, reconfigure, or disable the sampled heap checker.
+ *
+ * Every `interval` calls to malloc, free, realloc, or calloc, the checker
+ * inspects a few nodes of a random free list and walks a slice of the heap
+ * from there, checking the same invariants as mm_checkheap.  The slice
+ * grows or shrinks so that the runs cost about `budget_ns` nanoseconds per
+ * call on average.  Corruption is reported on stderr with the call count.
+ * Under MM_CHECK_ABORT the process then aborts; under MM_CHECK_QUARANTINE
+ * the allocator drops its free lists, leaks every later free, and takes
+ * new memory only from the top of the heap, so that a damaged heap is
+ * never handed out again.  mm_init disables the checker.
+ *
+ * @param[in] interval   Calls between runs, or 0 to disable the checker.
+ * @param[in] budget_ns  Average cost per call the runs may add.
+ * @param[in] action     What to do on corruption.
+ *
+ * @return  True on success, False if the heap is not initialized, the
+ *          budget is 0, or there is no room for the checker.
+ */
+extern bool mm_set_sampled_check(unsigned int interval,
+                                 unsigned int budget_ns,
+                                 mm_check_action_t action);
+
+/**
+ * @brief  Read the counters of the sampled heap checker, all zero while it
+ *         is disabled.
+ *
+ * @param[out] stats  Where to store the counters.
+ */
+extern void mm_get_check_stats(mm_check_stats_t *stats);
+
 /* This is for debugging.  Returns false if error encountered */
 /**
  * @brief  Check the heap for inconsistencies.
@@ -78,4 +523,8 @@ extern bool mm_init(void);
  */
 extern bool mm_checkheap(int line);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* mm.h */
@@ -0,0 +1,173 @@
+/**
+ * @file mm.hpp
+ * @brief C++ adapters over the allocator in mm.h: a polymorphic memory
+ *        resource, an STL allocator, and a monotonic resource over arenas
+ *
+ * Containers can be moved onto the allocator one at a time, either through
+ * std::pmr (std::pmr::map<K, V> m(mm::resource())) or through their
+ * allocator parameter (std::map<K, V, std::less<K>, mm::allocator<...>>).
+ * Every adapter allocates with mm_aligned_alloc and frees with
+ * mm_free_sized, so alignments above 16 bytes are honoured and frees skip
+ * the header when the front cache or the free buffer takes the block.
+ */
+
+#ifndef MM_HPP__
+#define MM_HPP__ 1
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+#include "mm.h"
+
+namespace mm {
+
+/**
+ * @brief  Allocate `bytes` bytes aligned to `align`, throwing on failure.
+ *
+ * Zero-byte requests get a one-byte block, since callers expect a distinct
+ * pointer.
+ */
+inline void *allocate_bytes(std::size_t bytes, std::size_t align) {
+    void *p = mm_aligned_alloc(align, bytes == 0 ? 1 : bytes);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+/**
+ * @brief  Free a block from allocate_bytes of `bytes` bytes.
+ */
+inline void deallocate_bytes(void *p, std::size_t bytes) noexcept {
+    mm_free_sized(p, bytes == 0 ? 1 : bytes);
+}
+
+/**
+ * @brief  A std::pmr::memory_resource backed by the heap.
+ *
+ * There is one heap, so every instance compares equal to every other, and
+ * memory allocated through one may be freed through another.
+ */
+class memory_resource : public std::pmr::memory_resource {
+  protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        return allocate_bytes(bytes, align);
+    }
+
+    void do_deallocate(void *p, std::size_t bytes,
+                       std::size_t /* align */) override {
+        deallocate_bytes(p, bytes);
+    }
+
+    bool do_is_equal(
+        const std::pmr::memory_resource &other) const noexcept override {
+        return dynamic_cast<const memory_resource *>(&other) != nullptr;
+    }
+};
+
+/**
+ * @brief  Return the process-wide instance of mm::memory_resource.
+ */
+inline memory_resource *resource() noexcept {
+    static memory_resource instance;
+    return &instance;
+}
+
+/**
+ * @brief  A stateless STL allocator backed by the heap.
+ *
+ * Deallocation passes the size of the array back to mm_free_sized, which
+ * every standard container does already.
+ */
+template <class T> class allocator {
+  public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using is_always_equal = std::true_type;
+
+    allocator() noexcept = default;
+
+    template <class U> allocator(const allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T *>(allocate_bytes(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept {
+        deallocate_bytes(p, n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+    return false;
+}
+
+/**
+ * @brief  A std::pmr::memory_resource that bump-allocates from an arena
+ *         (mm_arena_t) and frees nothing until release or destruction.
+ *
+ * The counterpart of std::pmr::monotonic_buffer_resource, with its chunks
+ * taken from the heap.  Not thread safe, like the arena.
+ */
+class monotonic_resource : public std::pmr::memory_resource {
+  public:
+    monotonic_resource() : arena_(mm_arena_create()) {
+        if (arena_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    monotonic_resource(const monotonic_resource &) = delete;
+    monotonic_resource &operator=(const monotonic_resource &) = delete;
+
+    ~monotonic_resource() override { mm_arena_destroy(arena_); }
+
+    /**
+     * @brief  Free everything allocated from the resource, keeping one chunk
+     *         for reuse.
+     */
+    void release() noexcept { mm_arena_reset(arena_); }
+
+  protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        // The arena aligns to 16 bytes; larger alignments take slack
+        std::size_t slack = align > 16 ? align - 16 : 0;
+        if (bytes > std::numeric_limits<std::size_t>::max() - slack - 1) {
+            throw std::bad_alloc();
+        }
+        void *p = mm_arena_alloc(arena_, bytes + slack + (bytes == 0));
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(p);
+        addr = (addr + align - 1) & ~(std::uintptr_t)(align - 1);
+        return reinterpret_cast<void *>(addr);
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(
+        const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+  private:
+    mm_arena_t *arena_;
+};
+
+} // namespace mm
+
+#endif /* mm.hpp */
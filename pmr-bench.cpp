@@ -0,0 +1,233 @@
+/**
+ * @file pmr-bench.cpp
+ * @brief Times standard containers on the allocator through the adapters in
+ *        mm.hpp, against glibc malloc and std::pmr::new_delete_resource
+ *
+ * Each workload runs once per allocator per round, and the best round is
+ * reported.  Every allocator must produce the same checksum.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.hpp"
+
+namespace {
+
+using key_vector = std::vector<int>;
+
+template <class A, class T>
+using rebind = typename std::allocator_traits<A>::template rebind_alloc<T>;
+
+/* Insert every key, look them all up, erase every other one, reinsert */
+template <class A> long map_workload(const A &alloc, const key_vector &keys) {
+    using value = std::pair<const int, int>;
+    std::map<int, int, std::less<int>, rebind<A, value>> m(alloc);
+    long sum = 0;
+    for (int k : keys) {
+        m[k] += k;
+    }
+    for (int k : keys) {
+        sum += m.find(k)->second;
+    }
+    for (std::size_t i = 0; i < keys.size(); i += 2) {
+        m.erase(keys[i]);
+    }
+    for (std::size_t i = 0; i < keys.size(); i += 2) {
+        m.emplace(keys[i], 1);
+    }
+    return sum + (long)m.size();
+}
+
+/* The same steps on a hash table, which also reallocates its buckets */
+template <class A>
+long unordered_workload(const A &alloc, const key_vector &keys) {
+    using value = std::pair<const int, int>;
+    std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                       rebind<A, value>>
+        m(alloc);
+    long sum = 0;
+    for (int k : keys) {
+        m[k] += k;
+    }
+    for (int k : keys) {
+        sum += m.find(k)->second;
+    }
+    for (std::size_t i = 0; i < keys.size(); i += 2) {
+        m.erase(keys[i]);
+    }
+    for (std::size_t i = 0; i < keys.size(); i += 2) {
+        m.emplace(keys[i], 1);
+    }
+    return sum + (long)m.size();
+}
+
+/* Grow many vectors of different lengths element by element */
+template <class A>
+long vector_workload(const A &alloc, const key_vector &keys) {
+    using inner = std::vector<int, rebind<A, int>>;
+    std::vector<inner, rebind<A, inner>> v(alloc);
+    long sum = 0;
+    for (std::size_t i = 0; i + 1 < keys.size(); i += 64) {
+        v.emplace_back();
+        std::size_t len = (std::size_t)keys[i] % 512;
+        for (std::size_t j = 0; j < len; j++) {
+            v.back().push_back(keys[i + 1]);
+        }
+    }
+    for (const inner &w : v) {
+        sum += (long)w.size();
+    }
+    return sum;
+}
+
+/* An allocator to run the workloads with */
+struct backend_t {
+    const char *name;
+    std::function<long(int, const key_vector &)> run; // Workload index
+    std::function<void()> release;                    // Called after a round
+};
+
+template <class A>
+std::function<long(int, const key_vector &)> workloads(A alloc) {
+    return [alloc](int w, const key_vector &keys) {
+        switch (w) {
+        case 0:
+            return map_workload(alloc, keys);
+        case 1:
+            return unordered_workload(alloc, keys);
+        default:
+            return vector_workload(alloc, keys);
+        }
+    };
+}
+
+const char *const workload_names[] = {"std::map", "std::unordered_map",
+                                      "std::vector"};
+const int num_workloads = 3;
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-hQ] [-n <n>] [-r <n>]\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n <n>     Number of keys (default 100000)\n");
+    fprintf(stderr, "\t-r <n>     Number of rounds (default 5)\n");
+    fprintf(stderr, "\t-Q         Keep freed small blocks in a front "
+                    "cache for reuse\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    std::size_t num_keys = 100000;
+    int rounds = 5;
+    bool front_cache = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "hn:r:Q")) != EOF) {
+        switch (c) {
+        case 'n':
+            num_keys = (std::size_t)atol(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'Q':
+            front_cache = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (num_keys < 2 || rounds < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    mem_init(false);
+    if (!mm_init() || (front_cache && !mm_set_front_cache(true))) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> dist(0, 4 * (int)num_keys);
+    key_vector keys(num_keys);
+    for (int &k : keys) {
+        k = dist(rng);
+    }
+
+    mm::monotonic_resource monotonic;
+    std::vector<backend_t> backends = {
+        {"glibc", workloads(std::allocator<char>()), [] {}},
+        {"mm::allocator", workloads(mm::allocator<char>()), [] {}},
+        {"pmr new_delete",
+         workloads(std::pmr::polymorphic_allocator<char>(
+             std::pmr::new_delete_resource())),
+         [] {}},
+        {"pmr mm", workloads(std::pmr::polymorphic_allocator<char>(
+                       mm::resource())),
+         [] {}},
+        {"pmr mm monotonic",
+         workloads(std::pmr::polymorphic_allocator<char>(&monotonic)),
+         [&monotonic] { monotonic.release(); }},
+    };
+
+    printf("%zu keys, best of %d rounds, milliseconds\n", num_keys, rounds);
+    printf("%-20s", "");
+    for (const backend_t &b : backends) {
+        printf("%18s", b.name);
+    }
+    printf("\n");
+
+    bool ok = true;
+    for (int w = 0; w < num_workloads; w++) {
+        printf("%-20s", workload_names[w]);
+        long expect = 0;
+        for (std::size_t i = 0; i < backends.size(); i++) {
+            double best = 0;
+            for (int r = 0; r < rounds; r++) {
+                auto start = std::chrono::steady_clock::now();
+                long sum = backends[i].run(w, keys);
+                std::chrono::duration<double, std::milli> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                backends[i].release();
+
+                if (i == 0 && r == 0) {
+                    expect = sum;
+                } else if (sum != expect) {
+                    ok = false;
+                }
+                if (r == 0 || elapsed.count() < best) {
+                    best = elapsed.count();
+                }
+            }
+            printf("%18.2f", best);
+        }
+        printf("\n");
+    }
+
+    printf("Heap size: %zu bytes\n", mem_heapsize());
+    if (!ok || !mm_checkheap(__LINE__)) {
+        fprintf(stderr, "ERROR: %s\n",
+                ok ? "heap check failed" : "checksums differ");
+        exit(1);
+    }
+    return 0;
+}
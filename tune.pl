@@ -0,0 +1,249 @@
+#!/usr/bin/perl
+use Getopt::Std;
+
+# Search the allocator tunables in mm.c (size class boundaries, heap
+# extension chunk size, fit policy and its patience, free list order, split
+# direction threshold) for the combination that
+# scores best on a set of traces, and write it out as a header that can
+# be passed to the Makefile as MM_CONFIG.
+
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] [-v] [-n N] [-r SEED] [-w WEIGHT] [-o FILE] [-t DIR] [TRACE ...]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "   -h              Print this message\n";
+    printf STDERR "   -v              Verbose mode\n";
+    printf STDERR "   -n N            Try N random candidates instead of the full grid\n";
+    printf STDERR "   -r SEED         Seed for the random search\n";
+    printf STDERR "   -w WEIGHT       Weight of utilization in the score (default 0.6)\n";
+    printf STDERR "   -o FILE         Write the winning header to FILE (default mm-tuned.h)\n";
+    printf STDERR "   -t DIR          Directory to find the traces in\n";
+    printf STDERR "Traces default to the driver's default trace set.\n";
+    die "\n";
+}
+
+$| = 1;       # Autoflush output on every print statement
+
+getopts('hvn:r:w:o:t:');
+
+if ($opt_h) {
+    &usage("");
+}
+
+$verbose = 0;
+if ($opt_v) {
+    $verbose = 1;
+}
+
+# Weight of utilization against throughput, as in the perf index
+$util_weight = 0.6;
+if (defined($opt_w)) {
+    $util_weight = $opt_w;
+    if ($util_weight < 0.0 || $util_weight > 1.0) {
+        die "Weight should be between 0.0 and 1.0\n";
+    }
+}
+
+$out_file = "mm-tuned.h";
+if ($opt_o) {
+    $out_file = $opt_o;
+}
+
+# Header holding the candidate being measured
+$candidate_file = ".mm-candidate.h";
+$tuneprog = "./mdriver-tune";
+
+# Driver arguments selecting the traces
+$trace_args = "";
+if ($opt_t) {
+    $trace_args .= " -t '$opt_t'";
+}
+for my $t (@ARGV) {
+    $trace_args .= " -f '$t'";
+}
+
+# Size class boundary sets for the blocks above the exact-size classes
+# (MM_EXACT_MAX, 1 KiB).  Each is a list of exclusive upper bounds; every
+# bound must be a multiple of 16 and larger than its predecessor.
+sub geometric_bounds
+{
+    my ($ratio) = @_;
+    my @bounds = ();
+    my $b = 2048.0;
+    while ($b <= 32768) {
+        my $r = int(($b + 15) / 16) * 16;
+        if (!@bounds || $r > $bounds[-1]) {
+            push(@bounds, $r);
+        }
+        $b *= $ratio;
+    }
+    return join(", ", @bounds);
+}
+
+%class_sets = (
+    "default" => "2048, 3072, 4096, 6656, 8192, 16384, 32768",
+    "pow2"    => &geometric_bounds(2.0),
+    "sqrt2"   => &geometric_bounds(sqrt(2.0)),
+    "ratio1.5" => &geometric_bounds(1.5),
+    "ratio3"  => &geometric_bounds(3.0),
+);
+
+# Search space, one list of candidate values per tunable
+@params = ("MM_CLASS_BOUNDS", "MM_CHUNKSIZE", "MM_FIT_POLICY",
+           "MM_FIT_PATIENCE", "MM_LIST_ORDER", "MM_SPLIT_THRESHOLD");
+%space = (
+    "MM_CLASS_BOUNDS" => [sort keys %class_sets],
+    "MM_CHUNKSIZE"    => [1024, 2048, 4096, 8192, 16384],
+    "MM_FIT_POLICY"   => ["MM_FIT_FIRST", "MM_FIT_NEXT", "MM_FIT_BEST",
+                          "MM_FIT_GOOD"],
+    "MM_FIT_PATIENCE" => [1, 2, 4, 8],
+    "MM_LIST_ORDER"   => ["MM_LIST_LIFO", "MM_LIST_ADDRESS"],
+    "MM_SPLIT_THRESHOLD" => [128, 256, 1024, 4096, "SIZE_MAX"],
+);
+# Value of each tunable that mm.c uses when it is not overridden
+%defaults = (
+    "MM_CLASS_BOUNDS" => "default",
+    "MM_CHUNKSIZE"    => 4096,
+    "MM_FIT_POLICY"   => "MM_FIT_GOOD",
+    "MM_FIT_PATIENCE" => 1,
+    "MM_LIST_ORDER"   => "MM_LIST_LIFO",
+    "MM_SPLIT_THRESHOLD" => 256,
+);
+
+# Text of the #define for a tunable
+sub param_value
+{
+    my ($name, $value) = @_;
+    if ($name eq "MM_CLASS_BOUNDS") {
+        return $class_sets{$value};
+    }
+    return $value;
+}
+
+# Write a candidate header; $cand is a hash reference
+sub write_header
+{
+    my ($file, $cand, $comment) = @_;
+    open(OUT, ">$file") or die "Couldn't write '$file'\n";
+    print OUT "/* $comment */\n";
+    for my $p (@params) {
+        my $v = &param_value($p, $cand->{$p});
+        print OUT "#define $p $v\n";
+    }
+    close OUT;
+}
+
+# Build the driver with a candidate and measure it.
+# Returns (utilization %, throughput Kops/sec), or () on failure.
+sub measure
+{
+    my ($cand) = @_;
+    &write_header($candidate_file, $cand, "tune.pl candidate");
+    unlink("mm-tune.o");
+    my $make_out = `make -s mdriver-tune MM_CONFIG=$candidate_file 2>&1`;
+    if ($? != 0) {
+        print STDERR $make_out;
+        return ();
+    }
+    my $run_out = `$tuneprog -v 0$trace_args 2>&1`;
+    my ($util, $tput);
+    if ($run_out =~ /Harmonic mean utilization = ([0-9.]*[0-9])%/) {
+        $util = $1;
+    }
+    if ($run_out =~ /Harmonic mean throughput \(Kops\/sec\) = ([0-9.]*[0-9])/) {
+        $tput = $1;
+    }
+    if ($? != 0 || !defined($util) || !defined($tput)) {
+        if ($verbose > 0) {
+            print STDERR $run_out;
+        }
+        return ();
+    }
+    return ($util, $tput);
+}
+
+# One-line description of a candidate
+sub describe
+{
+    my ($cand) = @_;
+    return join(" ", map { "$_=$cand->{$_}" } @params);
+}
+
+# Enumerate the full grid
+@grid = ({});
+for my $p (@params) {
+    my @next = ();
+    for my $c (@grid) {
+        for my $v (@{$space{$p}}) {
+            my %n = %$c;
+            $n{$p} = $v;
+            push(@next, \%n);
+        }
+    }
+    @grid = @next;
+}
+
+# Patience only matters to the good-fit policy
+@grid = grep { $_->{"MM_FIT_POLICY"} eq "MM_FIT_GOOD" ||
+               $_->{"MM_FIT_PATIENCE"} == $defaults{"MM_FIT_PATIENCE"} } @grid;
+
+# Random search samples the grid without replacement
+if ($opt_n && $opt_n < @grid) {
+    srand(defined($opt_r) ? $opt_r : time());
+    for (my $i = $#grid; $i > 0; $i -= 1) {
+        my $j = int(rand($i + 1));
+        @grid[$i, $j] = @grid[$j, $i];
+    }
+    @grid = @grid[0 .. $opt_n - 1];
+}
+
+# Throughput is scored relative to the untuned allocator
+my ($base_util, $base_tput) = &measure(\%defaults);
+if (!defined($base_tput) || $base_tput <= 0) {
+    die "Couldn't measure the default configuration\n";
+}
+print "Baseline: util $base_util%, throughput $base_tput Kops/sec\n";
+
+sub score
+{
+    my ($util, $tput) = @_;
+    return $util_weight * $util / 100.0 +
+           (1.0 - $util_weight) * $tput / $base_tput;
+}
+
+$best = \%defaults;
+$best_score = &score($base_util, $base_tput);
+$best_util = $base_util;
+$best_tput = $base_tput;
+
+$idx = 0;
+for my $cand (@grid) {
+    $idx += 1;
+    my ($util, $tput) = &measure($cand);
+    if (!defined($tput)) {
+        print "[$idx/" . scalar(@grid) . "] " . &describe($cand) . ": failed\n";
+        next;
+    }
+    my $s = &score($util, $tput);
+    printf("[%d/%d] %s: util %.1f%% thru %.0f score %.4f\n",
+           $idx, scalar(@grid), &describe($cand), $util, $tput, $s);
+    if ($s > $best_score) {
+        $best = $cand;
+        $best_score = $s;
+        $best_util = $util;
+        $best_tput = $tput;
+    }
+}
+
+unlink($candidate_file);
+unlink("mm-tune.o");
+
+&write_header($out_file, $best,
+              sprintf("Written by tune.pl: util %.1f%%, throughput %.0f " .
+                      "Kops/sec, score %.4f", $best_util, $best_tput,
+                      $best_score));
+printf("Best: %s (score %.4f)\n", &describe($best), $best_score);
+print "Wrote $out_file; build with \"make MM_CONFIG=$out_file\"\n";
+
+exit(0);